@@ -1,18 +1,1168 @@
 #include <Python.h>
 #include <structmember.h>
 #include <portaudio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 static PyObject *PortAudioError;
 
+/* concealment strategies for deadline mode */
+#define CONCEAL_SILENCE 0
+#define CONCEAL_REPEAT 1
+#define CONCEAL_CROSSFADE 2
+
+/* length of the seam smoothed by CONCEAL_CROSSFADE */
+#define CROSSFADE_FRAMES 64
+
+/* scheduled event types */
+#define EVENT_GAIN 0
+#define EVENT_STOP 1
+#define EVENT_TRIGGER 2
+
+/* capacity of the per-stream event queue; must be a power of two */
+#define EVENT_QUEUE_SIZE 256
+
+#define ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ATOMIC_INCREMENT(p) __atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#define ATOMIC_LOAD_DOUBLE(p, v) __atomic_load(p, v, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE_DOUBLE(p, v) __atomic_store(p, v, __ATOMIC_RELEASE)
+
+#define CLAMP(x, lo, hi) ((x) < (lo) ? (lo) : (x) > (hi) ? (hi) : (x))
+
+/* limits of the per-stream sample bank */
+#define MAX_SAMPLES 1024
+#define MAX_VOICES 32
+#define SAMPLE_ALIGNMENT 64
+
+/* limits of the per-stream parameter block */
+#define MAX_PARAMS 64
+#define MAX_PARAM_NAME 32
+
+/* channel counts up to this get their own conversion kernels */
+#define MAX_KERNEL_CHANNELS 8
+
+/* the latency tuner steps the buffer size up when the callback uses more
+ * than TUNE_HIGH_LOAD of the buffer period on average, and down after
+ * TUNE_BUFFERS buffers under TUNE_LOW_LOAD; the suggested latency follows the
+ * buffer size */
+#define TUNE_HIGH_LOAD 0.75
+#define TUNE_LOW_LOAD 0.35
+#define TUNE_BUFFERS 64
+#define TUNE_LATENCY_BUFFERS 2
+
+/* capacity of the passthrough side-chain ring buffer, in buffers */
+#define SIDECHAIN_BUFFERS 8
+
+/* states of the block handed from the audio thread to the deadline worker */
+#define JOB_IDLE 0
+#define JOB_PENDING 1
+#define JOB_DONE 2
+
+/* The kernels for a format are selected once when the stream is opened.
+ * scale[n] applies a per-channel gain to interleaved frames of n channels;
+ * scale[0] handles any channel count. */
+typedef void (*ScaleKernel)(void *buffer, const double *gain,
+                            unsigned long frames, int channels);
+
+typedef struct {
+    PyObject *(*toList)(const void *buffer, unsigned long n);
+    int (*fromList)(PyObject *list, void *buffer, unsigned long n);
+    void (*load)(const void *buffer, double *samples, unsigned long n);
+    void (*store)(const double *samples, void *buffer, unsigned long n);
+    ScaleKernel scale[MAX_KERNEL_CHANNELS + 1];
+} Kernels;
+
+/* An event is stamped either with a frame position or with a stream time,
+ * which the audio thread converts to a frame position when it dequeues it. */
+typedef struct {
+    int type;
+    int target;
+    int byFrame;
+    double time;
+    long long frame;
+    double value;
+    unsigned long duration;
+} Event;
+
+/* Sample bank entries are written once by Python before being published to
+ * the audio thread. A voice plays one of them. */
+typedef struct {
+    void *data;
+    unsigned long frames;
+} Sample;
+
+typedef struct {
+    int active;
+    int sample;
+    unsigned long position;
+    double gain;
+    long long started;
+} Voice;
+
+/* A parameter's target is written by Python and read by the audio thread,
+ * which moves its value towards the target over 'smoothing' frames. */
+typedef struct {
+    char name[MAX_PARAM_NAME];
+    int isInt;
+    unsigned long smoothing;
+    double target;
+    double value, step, rampTarget;
+    unsigned long remaining;
+} Param;
+
 /* Stream (PaStream) */
 
 typedef struct {
     PyObject_HEAD
     PaStream *stream;
+    int numInputChannels, numOutputChannels;
+    PaSampleFormat sampleFormat;
+    int sampleSize;
+    const Kernels *kernels;
+    ScaleKernel scale;
+    double sampleRate;
+    unsigned long framesPerBuffer;
+    PyObject *callback, *userData;
+
+    /* exception raised by the callback, waiting to be raised in the main
+     * thread */
+    PyObject *errorType, *errorValue, *errorTraceback;
+    long missCount;
+    /* set with the GIL held once the Stream is being deallocated, after
+     * which callback errors are printed rather than deferred */
+    int deallocating;
+
+    /* deadline mode; budget is the fraction of the buffer period the audio
+     * thread will wait for the Python callback, or 0.0 if disabled */
+    double budget;
+    int concealment;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t worker;
+    int workerRunning, workerQuit;
+    int jobState, jobAbandoned, jobResult, finishing;
+    unsigned long jobFrames;
+    PaStreamCallbackTimeInfo jobTime;
+    PaStreamCallbackFlags jobFlags;
+    void *jobInput, *jobOutput, *lastOutput;
+    int haveLast;
+
+    /* event scheduler; the queue is written by Python with the GIL held and
+     * read by the audio thread, which keeps due events in a list sorted by
+     * descending frame so the next one is at the end */
+    Event queue[EVENT_QUEUE_SIZE];
+    unsigned int queueHead, queueTail;
+    Event pending[EVENT_QUEUE_SIZE];
+    int pendingCount;
+    long long frame;
+    double *gain, *gainStep;
+    unsigned long *gainRemaining;
+    /* the gains EVENT_STOP muted, restored when the stream is restarted */
+    double *stopGain;
+    int stopping;
+
+    /* passthrough; input is mixed to output by the audio thread, and every
+     * decimation'th input frame goes through a ring buffer to the callback
+     * on the worker thread */
+    int routeCount;
+    int *routeInput, *routeOutput;
+    double *routeGain;
+    double *mixInput, *mix;
+    int decimation, decimationPhase;
+    char *ring;
+    unsigned long ringSize;
+    unsigned long ringHead, ringTail;
+
+    /* sample bank; voices belong to the audio thread */
+    Sample samples[MAX_SAMPLES];
+    int sampleCount;
+    Voice voices[MAX_VOICES];
+    double *voiceMix, *voiceInput;
+
+    /* parameter block; paramValues is the view exposed to Python through
+     * the buffer interface */
+    Param params[MAX_PARAMS];
+    double paramValues[MAX_PARAMS];
+    int paramCount;
+    int *routeParam;
+
+    /* latency tuner; the audio thread gathers statistics which
+     * stream.tune() acts on. A suggested latency of 0.0 means the default
+     * devices' low latency. */
+    double suggestedLatency;
+    int tuning, tuneSettled;
+    unsigned long tuneMin, tuneMax, tuneFloor;
+    long tuneBuffers, tuneUnderflows, tuneMisses, tuneQuiet;
+    double tuneLoad;
 } Stream;
 
+static int call_callback(Stream *self, const void *inputBuffer,
+                         void *outputBuffer, unsigned long framesPerBuffer,
+                         const PaStreamCallbackTimeInfo *timeInfo,
+                         PaStreamCallbackFlags statusFlags);
+static int paTestCallback(const void *inputBuffer, void *outputBuffer,
+                          unsigned long framesPerBuffer,
+                          const PaStreamCallbackTimeInfo *timeInfo,
+                          PaStreamCallbackFlags statusFlags,
+                          void *userData);
+
+/* conversion kernels */
+
+#define ROUND(x) ((long)((x) < 0.0 ? (x) - 0.5 : (x) + 0.5))
+
+/* Samples are processed in C as doubles on the scale of the device format,
+ * with UINT8 re-centred on zero. Integer formats are rounded and clipped to
+ * their range on the way back. */
+
+static inline double float32_to_double(float v) {
+    return v;
+}
+
+static inline float float32_from_double(double v) {
+    return (float)v;
+}
+
+static inline double int32_to_double(int v) {
+    return v;
+}
+
+static inline int int32_from_double(double v) {
+    return (int)ROUND(CLAMP(v, -2147483648.0, 2147483647.0));
+}
+
+static inline double int16_to_double(short v) {
+    return v;
+}
+
+static inline short int16_from_double(double v) {
+    return (short)ROUND(CLAMP(v, -32768.0, 32767.0));
+}
+
+static inline double int8_to_double(signed char v) {
+    return v;
+}
+
+static inline signed char int8_from_double(double v) {
+    return (signed char)ROUND(CLAMP(v, -128.0, 127.0));
+}
+
+static inline double uint8_to_double(unsigned char v) {
+    return v - 128.0;
+}
+
+static inline unsigned char uint8_from_double(double v) {
+    return (unsigned char)(ROUND(CLAMP(v, -128.0, 127.0)) + 128);
+}
+
+/* INT24 samples are packed little-endian in three bytes */
+
+static inline long int24_get(const unsigned char *p) {
+    return (long)((int)((unsigned)p[0] << 8 | (unsigned)p[1] << 16 |
+                        (unsigned)p[2] << 24) >> 8);
+}
+
+static inline void int24_set(unsigned char *p, long v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+}
+
+static inline long int24_from_double(double v) {
+    return ROUND(CLAMP(v, -8388608.0, 8388607.0));
+}
+
+#define DEFINE_LIST_KERNELS(name, type, pyType, toPy, fromPy) \
+static PyObject *name##_to_list(const void *buffer, unsigned long n) { \
+    const type *p = (const type*)buffer; \
+    PyObject *list = PyList_New(n); \
+    unsigned long i; \
+    if (!list) \
+        return NULL; \
+    for (i = 0; i < n; i++) { \
+        PyObject *value = toPy(p[i]); \
+        if (!value) { \
+            Py_DECREF(list); \
+            return NULL; \
+        } \
+        PyList_SET_ITEM(list, i, value); \
+    } \
+    return list; \
+} \
+\
+static int name##_from_list(PyObject *list, void *buffer, unsigned long n) { \
+    type *p = (type*)buffer; \
+    unsigned long i; \
+    for (i = 0; i < n; i++) { \
+        pyType value = fromPy(PyList_GET_ITEM(list, i)); \
+        if (value == -1 && PyErr_Occurred()) \
+            return -1; \
+        p[i] = (type)value; \
+    } \
+    return 0; \
+}
+
+#define DEFINE_SAMPLE_KERNELS(name, type) \
+static void name##_load(const void *buffer, double *samples, unsigned long n) { \
+    const type *p = (const type*)buffer; \
+    unsigned long i; \
+    for (i = 0; i < n; i++) \
+        samples[i] = name##_to_double(p[i]); \
+} \
+\
+static void name##_store(const double *samples, void *buffer, \
+                         unsigned long n) { \
+    type *p = (type*)buffer; \
+    unsigned long i; \
+    for (i = 0; i < n; i++) \
+        p[i] = name##_from_double(samples[i]); \
+}
+
+/* 'channels' is a constant in the specialized kernels, so the compiler can
+ * unroll the inner loop and vectorize across frames */
+#define DEFINE_SCALE_KERNEL(name, type, suffix, count) \
+static void scale_##name##_##suffix(void *buffer, const double *gain, \
+                                    unsigned long frames, int channels) { \
+    type *p = (type*)buffer; \
+    unsigned long i; \
+    int c; \
+    for (i = 0; i < frames; i++, p += (count)) \
+        for (c = 0; c < (count); c++) \
+            p[c] = name##_from_double(name##_to_double(p[c]) * gain[c]); \
+}
+
+#define DEFINE_KERNELS(name, type, pyType, toPy, fromPy) \
+DEFINE_LIST_KERNELS(name, type, pyType, toPy, fromPy) \
+DEFINE_SAMPLE_KERNELS(name, type) \
+DEFINE_SCALE_KERNEL(name, type, n, channels) \
+DEFINE_SCALE_KERNEL(name, type, 1, 1) \
+DEFINE_SCALE_KERNEL(name, type, 2, 2) \
+DEFINE_SCALE_KERNEL(name, type, 3, 3) \
+DEFINE_SCALE_KERNEL(name, type, 4, 4) \
+DEFINE_SCALE_KERNEL(name, type, 5, 5) \
+DEFINE_SCALE_KERNEL(name, type, 6, 6) \
+DEFINE_SCALE_KERNEL(name, type, 7, 7) \
+DEFINE_SCALE_KERNEL(name, type, 8, 8)
+
+#define KERNELS(name) \
+    {name##_to_list, name##_from_list, name##_load, name##_store, \
+     {scale_##name##_n, scale_##name##_1, scale_##name##_2, \
+      scale_##name##_3, scale_##name##_4, scale_##name##_5, \
+      scale_##name##_6, scale_##name##_7, scale_##name##_8}}
+
+DEFINE_KERNELS(float32, float, double, PyFloat_FromDouble, PyFloat_AsDouble)
+DEFINE_KERNELS(int32, int, long, PyInt_FromLong, PyInt_AsLong)
+DEFINE_KERNELS(int16, short, long, PyInt_FromLong, PyInt_AsLong)
+DEFINE_KERNELS(int8, signed char, long, PyInt_FromLong, PyInt_AsLong)
+DEFINE_KERNELS(uint8, unsigned char, long, PyInt_FromLong, PyInt_AsLong)
+
+static PyObject *int24_to_list(const void *buffer, unsigned long n) {
+    const unsigned char *p = (const unsigned char*)buffer;
+    PyObject *list = PyList_New(n);
+    unsigned long i;
+    if (!list)
+        return NULL;
+    for (i = 0; i < n; i++) {
+        PyObject *value = PyInt_FromLong(int24_get(p + i * 3));
+        if (!value) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, value);
+    }
+    return list;
+}
+
+static int int24_from_list(PyObject *list, void *buffer, unsigned long n) {
+    unsigned char *p = (unsigned char*)buffer;
+    unsigned long i;
+    for (i = 0; i < n; i++) {
+        long value = PyInt_AsLong(PyList_GET_ITEM(list, i));
+        if (value == -1 && PyErr_Occurred())
+            return -1;
+        int24_set(p + i * 3, value);
+    }
+    return 0;
+}
+
+static void int24_load(const void *buffer, double *samples, unsigned long n) {
+    const unsigned char *p = (const unsigned char*)buffer;
+    unsigned long i;
+    for (i = 0; i < n; i++)
+        samples[i] = int24_get(p + i * 3);
+}
+
+static void int24_store(const double *samples, void *buffer, unsigned long n) {
+    unsigned char *p = (unsigned char*)buffer;
+    unsigned long i;
+    for (i = 0; i < n; i++)
+        int24_set(p + i * 3, int24_from_double(samples[i]));
+}
+
+static void scale_int24(void *buffer, const double *gain, unsigned long frames,
+                        int channels) {
+    unsigned char *p = (unsigned char*)buffer;
+    unsigned long i;
+    int c;
+    for (i = 0; i < frames; i++)
+        for (c = 0; c < channels; c++, p += 3)
+            int24_set(p, int24_from_double(int24_get(p) * gain[c]));
+}
+
+static const Kernels float32Kernels = KERNELS(float32);
+static const Kernels int32Kernels = KERNELS(int32);
+static const Kernels int16Kernels = KERNELS(int16);
+static const Kernels int8Kernels = KERNELS(int8);
+static const Kernels uint8Kernels = KERNELS(uint8);
+static const Kernels int24Kernels = {
+    int24_to_list, int24_from_list, int24_load, int24_store,
+    {scale_int24, scale_int24, scale_int24, scale_int24, scale_int24,
+     scale_int24, scale_int24, scale_int24, scale_int24}
+};
+
+static const Kernels *find_kernels(PaSampleFormat format) {
+    switch (format) {
+    case paFloat32:
+        return &float32Kernels;
+    case paInt32:
+        return &int32Kernels;
+    case paInt24:
+        return &int24Kernels;
+    case paInt16:
+        return &int16Kernels;
+    case paInt8:
+        return &int8Kernels;
+    case paUInt8:
+        return &uint8Kernels;
+    }
+    return NULL;
+}
+
+/* Single-sample access, for the paths that are too rare to deserve a
+ * kernel: concealment and gain ramps. */
+
+static double read_sample(PaSampleFormat format, const void *buffer,
+                          unsigned long i) {
+    switch (format) {
+    case paFloat32:
+        return float32_to_double(((float*)buffer)[i]);
+    case paInt32:
+        return int32_to_double(((int*)buffer)[i]);
+    case paInt24:
+        return int24_get((const unsigned char*)buffer + i * 3);
+    case paInt16:
+        return int16_to_double(((short*)buffer)[i]);
+    case paInt8:
+        return int8_to_double(((signed char*)buffer)[i]);
+    case paUInt8:
+        return uint8_to_double(((unsigned char*)buffer)[i]);
+    }
+    return 0.0;
+}
+
+static void write_sample(PaSampleFormat format, void *buffer, unsigned long i,
+                         double value) {
+    switch (format) {
+    case paFloat32:
+        ((float*)buffer)[i] = float32_from_double(value);
+        break;
+    case paInt32:
+        ((int*)buffer)[i] = int32_from_double(value);
+        break;
+    case paInt24:
+        int24_set((unsigned char*)buffer + i * 3, int24_from_double(value));
+        break;
+    case paInt16:
+        ((short*)buffer)[i] = int16_from_double(value);
+        break;
+    case paInt8:
+        ((signed char*)buffer)[i] = int8_from_double(value);
+        break;
+    case paUInt8:
+        ((unsigned char*)buffer)[i] = uint8_from_double(value);
+        break;
+    }
+}
+
+/* deadline mode */
+
+/* Fill the output buffer in place of a block the Python callback failed to
+ * deliver, using the previous block (if any) as the source. */
+static void conceal(Stream *self, void *outputBuffer,
+                    unsigned long framesPerBuffer) {
+    PaSampleFormat format = self->sampleFormat;
+    int channels = self->numOutputChannels;
+    int haveLast = self->haveLast && self->lastOutput &&
+                   framesPerBuffer == self->framesPerBuffer;
+    unsigned long i, last = (framesPerBuffer - 1) * channels;
+    int c;
+
+    if (!outputBuffer || !framesPerBuffer)
+        return;
+
+    if (!haveLast || self->concealment == CONCEAL_SILENCE) {
+        /* ramp the final frame of the previous block down to silence */
+        for (i = 0; i < framesPerBuffer; i++) {
+            double gain = 1.0 - (double)(i + 1) / framesPerBuffer;
+            for (c = 0; c < channels; c++) {
+                double held = haveLast ?
+                    read_sample(format, self->lastOutput, last + c) : 0.0;
+                write_sample(format, outputBuffer, i * channels + c,
+                             held * gain);
+            }
+        }
+    } else if (self->concealment == CONCEAL_REPEAT) {
+        memcpy(outputBuffer, self->lastOutput,
+               framesPerBuffer * channels * self->sampleSize);
+    } else {
+        /* repeat the previous block, smoothing the seam between its final
+         * frame and its first frames */
+        unsigned long fade = framesPerBuffer < CROSSFADE_FRAMES ?
+                             framesPerBuffer : CROSSFADE_FRAMES;
+        memcpy(outputBuffer, self->lastOutput,
+               framesPerBuffer * channels * self->sampleSize);
+        for (c = 0; c < channels; c++) {
+            double held = read_sample(format, self->lastOutput, last + c);
+            for (i = 0; i < fade; i++) {
+                double w = (double)(i + 1) / (fade + 1);
+                double value = read_sample(format, self->lastOutput,
+                                           i * channels + c);
+                write_sample(format, outputBuffer, i * channels + c,
+                             (1.0 - w) * held + w * value);
+            }
+        }
+    }
+
+    /* repeated blocks keep repeating the last block that was delivered */
+    if (self->lastOutput && framesPerBuffer == self->framesPerBuffer &&
+            (!haveLast || self->concealment == CONCEAL_SILENCE)) {
+        memcpy(self->lastOutput, outputBuffer,
+               framesPerBuffer * channels * self->sampleSize);
+        self->haveLast = 1;
+    }
+}
+
+/* Compute the absolute monotonic time 'seconds' from now, for use with
+ * pthread_cond_timedwait. */
+static void time_from_now(struct timespec *ts, double seconds) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += (time_t)seconds;
+    ts->tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static void *deadline_worker(void *arg) {
+    Stream *self = (Stream*)arg;
+    PyGILState_STATE gstate;
+    int result;
+
+    pthread_mutex_lock(&self->mutex);
+    for (;;) {
+        while (self->jobState != JOB_PENDING && !self->workerQuit)
+            pthread_cond_wait(&self->cond, &self->mutex);
+        if (self->workerQuit)
+            break;
+        pthread_mutex_unlock(&self->mutex);
+
+        memset(self->jobOutput, 0, self->jobFrames *
+               self->numOutputChannels * self->sampleSize);
+        gstate = PyGILState_Ensure();
+        result = call_callback(self, self->jobInput, self->jobOutput,
+                               self->jobFrames, &self->jobTime,
+                               self->jobFlags);
+        PyGILState_Release(gstate);
+
+        pthread_mutex_lock(&self->mutex);
+        self->jobResult = result;
+        if (self->jobAbandoned) {
+            /* the audio thread has already concealed this block */
+            if (result == paComplete || result == paAbort)
+                self->finishing = result;
+            self->jobAbandoned = 0;
+            self->jobState = JOB_IDLE;
+        } else {
+            self->jobState = JOB_DONE;
+        }
+        pthread_cond_broadcast(&self->cond);
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return NULL;
+}
+
+/* Hand the block to the worker thread and wait for the Python callback
+ * until the budgeted part of the buffer period has elapsed. Runs on the
+ * audio thread without the GIL. */
+static int deadline_callback(Stream *self, const void *inputBuffer,
+                             void *outputBuffer,
+                             unsigned long framesPerBuffer,
+                             const PaStreamCallbackTimeInfo *timeInfo,
+                             PaStreamCallbackFlags statusFlags) {
+    struct timespec deadline;
+    int result;
+
+    time_from_now(&deadline, self->budget * framesPerBuffer / self->sampleRate);
+
+    pthread_mutex_lock(&self->mutex);
+    if (self->finishing) {
+        result = self->finishing;
+        pthread_mutex_unlock(&self->mutex);
+        conceal(self, outputBuffer, framesPerBuffer);
+        return result;
+    }
+
+    if (self->jobState == JOB_IDLE &&
+            framesPerBuffer <= self->framesPerBuffer) {
+        if (inputBuffer)
+            memcpy(self->jobInput, inputBuffer, framesPerBuffer *
+                   self->numInputChannels * self->sampleSize);
+        self->jobFrames = framesPerBuffer;
+        self->jobTime = *timeInfo;
+        self->jobFlags = statusFlags;
+        self->jobState = JOB_PENDING;
+        pthread_cond_broadcast(&self->cond);
+    }
+
+    while (self->jobState == JOB_PENDING && !self->jobAbandoned) {
+        if (pthread_cond_timedwait(&self->cond, &self->mutex,
+                                   &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if (self->jobState == JOB_DONE) {
+        self->jobState = JOB_IDLE;
+        result = self->jobResult;
+        if (result >= 0) {
+            if (outputBuffer) {
+                memcpy(outputBuffer, self->jobOutput, framesPerBuffer *
+                       self->numOutputChannels * self->sampleSize);
+                memcpy(self->lastOutput, self->jobOutput, framesPerBuffer *
+                       self->numOutputChannels * self->sampleSize);
+                self->haveLast = 1;
+            }
+            pthread_mutex_unlock(&self->mutex);
+            return result;
+        }
+    } else if (self->jobState == JOB_PENDING) {
+        self->jobAbandoned = 1;
+    }
+    pthread_mutex_unlock(&self->mutex);
+
+    conceal(self, outputBuffer, framesPerBuffer);
+    ATOMIC_INCREMENT(&self->missCount);
+    return paContinue;
+}
+
+/* The deadline is measured against the monotonic clock. */
+static void init_cond(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* parameter block */
+
+/* Pick up new targets at the start of a buffer and publish the values the
+ * buffer starts from, so that the callback sees them. Runs on the audio
+ * thread. */
+static void begin_params(Stream *self) {
+    int i, count = ATOMIC_LOAD(&self->paramCount);
+
+    for (i = 0; i < count; i++) {
+        Param *param = &self->params[i];
+        double target;
+        ATOMIC_LOAD_DOUBLE(&param->target, &target);
+        if (target != param->rampTarget) {
+            param->rampTarget = target;
+            if (param->smoothing) {
+                param->step = (target - param->value) / param->smoothing;
+                param->remaining = param->smoothing;
+            } else {
+                param->value = target;
+                param->remaining = 0;
+            }
+        }
+        ATOMIC_STORE_DOUBLE(&self->paramValues[i], &param->value);
+    }
+}
+
+/* The value of a parameter 'offset' frames into the current buffer. */
+static inline double param_value(const Param *param, unsigned long offset) {
+    if (offset < param->remaining)
+        return param->value + param->step * (offset + 1);
+    return param->remaining ? param->rampTarget : param->value;
+}
+
+/* Advance the parameters past the current buffer. Runs on the audio
+ * thread. */
+static void end_params(Stream *self, unsigned long framesPerBuffer) {
+    int i, count = ATOMIC_LOAD(&self->paramCount);
+
+    for (i = 0; i < count; i++) {
+        Param *param = &self->params[i];
+        if (param->remaining > framesPerBuffer) {
+            param->value += param->step * framesPerBuffer;
+            param->remaining -= framesPerBuffer;
+        } else if (param->remaining) {
+            param->value = param->rampTarget;
+            param->remaining = 0;
+        }
+    }
+}
+
+/* passthrough */
+
+/* Copy up to 'frames' frames out of the side-chain ring buffer. Runs on the
+ * worker thread. */
+static unsigned long read_ring(Stream *self, void *buffer, unsigned long frames) {
+    size_t frameSize = self->numInputChannels * self->sampleSize;
+    unsigned long tail = self->ringTail;
+    unsigned long available = (ATOMIC_LOAD(&self->ringHead) + self->ringSize -
+                               tail) % self->ringSize;
+    unsigned long i, n = available < frames ? available : frames;
+
+    for (i = 0; i < n; i++) {
+        memcpy((char*)buffer + i * frameSize, self->ring + tail * frameSize,
+               frameSize);
+        tail = (tail + 1) % self->ringSize;
+    }
+    ATOMIC_STORE(&self->ringTail, tail);
+    return n;
+}
+
+/* Copy every decimation'th input frame into the side-chain ring buffer,
+ * dropping the buffer if the worker has fallen behind. Runs on the audio
+ * thread. */
+static void write_ring(Stream *self, const void *inputBuffer,
+                       unsigned long framesPerBuffer) {
+    size_t frameSize = self->numInputChannels * self->sampleSize;
+    unsigned long head = self->ringHead;
+    unsigned long space = (ATOMIC_LOAD(&self->ringTail) + self->ringSize -
+                           head - 1) % self->ringSize;
+    unsigned long i = (self->decimation - self->decimationPhase) %
+                      self->decimation;
+    unsigned long count = i < framesPerBuffer ?
+        (framesPerBuffer - i + self->decimation - 1) / self->decimation : 0;
+
+    if (count > space) {
+        ATOMIC_INCREMENT(&self->missCount);
+    } else {
+        for (; i < framesPerBuffer; i += self->decimation) {
+            memcpy(self->ring + head * frameSize,
+                   (const char*)inputBuffer + i * frameSize, frameSize);
+            head = (head + 1) % self->ringSize;
+        }
+        ATOMIC_STORE(&self->ringHead, head);
+    }
+    self->decimationPhase = (self->decimationPhase + framesPerBuffer) %
+                            self->decimation;
+
+    /* never block the audio thread; the worker also polls once per buffer */
+    if (pthread_mutex_trylock(&self->mutex) == 0) {
+        pthread_cond_signal(&self->cond);
+        pthread_mutex_unlock(&self->mutex);
+    }
+}
+
+/* Mix the routed input channels to the output without calling Python. Runs
+ * on the audio thread. */
+static int passthrough_callback(Stream *self, const void *inputBuffer,
+                                void *outputBuffer,
+                                unsigned long framesPerBuffer) {
+    int inputs = self->numInputChannels, outputs = self->numOutputChannels;
+    double *in = self->mixInput, *out = self->mix;
+    unsigned long i;
+    int r;
+
+    if (outputBuffer && framesPerBuffer <= self->framesPerBuffer) {
+        memset(out, 0, framesPerBuffer * outputs * sizeof(double));
+        if (inputBuffer) {
+            self->kernels->load(inputBuffer, in, framesPerBuffer * inputs);
+            for (r = 0; r < self->routeCount; r++) {
+                const double *src = in + self->routeInput[r];
+                double *dst = out + self->routeOutput[r];
+                double gain = self->routeGain[r];
+                if (self->routeParam[r] >= 0) {
+                    const Param *param = &self->params[self->routeParam[r]];
+                    for (i = 0; i < framesPerBuffer; i++)
+                        dst[i * outputs] += param_value(param, i) *
+                                            src[i * inputs];
+                    continue;
+                }
+                for (i = 0; i < framesPerBuffer; i++)
+                    dst[i * outputs] += gain * src[i * inputs];
+            }
+        }
+        self->kernels->store(out, outputBuffer, framesPerBuffer * outputs);
+    } else if (outputBuffer) {
+        for (i = 0; i < framesPerBuffer * outputs; i++)
+            write_sample(self->sampleFormat, outputBuffer, i, 0.0);
+    }
+
+    if (inputBuffer && self->decimation)
+        write_ring(self, inputBuffer, framesPerBuffer);
+
+    return ATOMIC_LOAD(&self->finishing);
+}
+
+static void *sidechain_worker(void *arg) {
+    Stream *self = (Stream*)arg;
+    double period = self->framesPerBuffer / self->sampleRate;
+    PyGILState_STATE gstate;
+    PaStreamCallbackTimeInfo timeInfo;
+    struct timespec wake;
+    unsigned long frames;
+    int result;
+
+    pthread_mutex_lock(&self->mutex);
+    while (!self->workerQuit) {
+        time_from_now(&wake, period);
+        pthread_cond_timedwait(&self->cond, &self->mutex, &wake);
+        pthread_mutex_unlock(&self->mutex);
+
+        while ((frames = read_ring(self, self->jobInput,
+                                   self->framesPerBuffer))) {
+            /* input times are estimated from the amount of buffered input */
+            unsigned long buffered = (ATOMIC_LOAD(&self->ringHead) +
+                                      self->ringSize - self->ringTail) %
+                                     self->ringSize;
+            timeInfo.currentTime = Pa_GetStreamTime(self->stream);
+            timeInfo.inputBufferAdcTime = timeInfo.currentTime -
+                (double)(buffered + frames) * self->decimation /
+                self->sampleRate;
+            timeInfo.outputBufferDacTime = 0.0;
+            memset(self->jobOutput, 0, frames * self->numOutputChannels *
+                   self->sampleSize);
+
+            gstate = PyGILState_Ensure();
+            result = call_callback(self, self->jobInput, self->jobOutput,
+                                   frames, &timeInfo, 0);
+            PyGILState_Release(gstate);
+
+            if (result < 0)
+                ATOMIC_INCREMENT(&self->missCount);
+            else if (result == paComplete || result == paAbort)
+                ATOMIC_STORE(&self->finishing, result);
+        }
+        pthread_mutex_lock(&self->mutex);
+    }
+    pthread_mutex_unlock(&self->mutex);
+    return NULL;
+}
+
+static int start_worker(Stream *self) {
+    self->jobState = JOB_IDLE;
+    self->jobAbandoned = 0;
+    self->finishing = 0;
+    self->workerQuit = 0;
+    self->haveLast = 0;
+    self->ringHead = self->ringTail = 0;
+    self->decimationPhase = 0;
+    if (pthread_create(&self->worker, NULL, self->routeCount ?
+                       sidechain_worker : deadline_worker, self)) {
+        PyErr_SetString(PortAudioError, "could not start worker thread");
+        return -1;
+    }
+    self->workerRunning = 1;
+    return 0;
+}
+
+/* Must be called without the GIL, since the worker may be waiting for it. */
+static void stop_worker(Stream *self) {
+    if (!self->workerRunning)
+        return;
+    pthread_mutex_lock(&self->mutex);
+    self->workerQuit = 1;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->mutex);
+    pthread_join(self->worker, NULL);
+    self->workerRunning = 0;
+}
+
+/* Stop the stream and its worker before closing it, since the side-chain
+ * worker reads the stream's clock. Must be called without the GIL. */
+static PaError close_stream(Stream *self) {
+    if (Pa_IsStreamStopped(self->stream) == 0)
+        Pa_AbortStream(self->stream);
+    stop_worker(self);
+    return Pa_CloseStream(self->stream);
+}
+
+/* event scheduler */
+
+/* Start a voice, stealing the oldest one if they are all playing. */
+static void start_voice(Stream *self, int sample, double gain) {
+    Voice *voice = &self->voices[0];
+    int i;
+
+    for (i = 0; i < MAX_VOICES; i++) {
+        if (!self->voices[i].active) {
+            voice = &self->voices[i];
+            break;
+        }
+        if (self->voices[i].started < voice->started)
+            voice = &self->voices[i];
+    }
+    voice->active = 1;
+    voice->sample = sample;
+    voice->position = 0;
+    voice->gain = gain;
+    voice->started = self->frame;
+}
+
+/* Mix the playing voices into part of the output buffer. */
+static void mix_voices(Stream *self, void *outputBuffer, unsigned long start,
+                       unsigned long end) {
+    int channels = self->numOutputChannels;
+    size_t offset = start * channels;
+    unsigned long i, frames = end - start;
+    int v, mixed = 0;
+
+    for (v = 0; v < MAX_VOICES; v++) {
+        Voice *voice = &self->voices[v];
+        const Sample *sample;
+        unsigned long n;
+        if (!voice->active)
+            continue;
+        sample = &self->samples[voice->sample];
+        n = sample->frames - voice->position;
+        if (n > frames)
+            n = frames;
+        if (!mixed) {
+            self->kernels->load((char*)outputBuffer + offset * self->sampleSize,
+                                self->voiceMix, frames * channels);
+            mixed = 1;
+        }
+        self->kernels->load((char*)sample->data + voice->position * channels *
+                            self->sampleSize, self->voiceInput, n * channels);
+        for (i = 0; i < n * channels; i++)
+            self->voiceMix[i] += voice->gain * self->voiceInput[i];
+        voice->position += n;
+        if (voice->position >= sample->frames)
+            voice->active = 0;
+    }
+    if (mixed)
+        self->kernels->store(self->voiceMix, (char*)outputBuffer +
+                             offset * self->sampleSize, frames * channels);
+}
+
+static void apply_event(Stream *self, const Event *event) {
+    int c, first = 0, last = self->numOutputChannels - 1;
+
+    switch (event->type) {
+    case EVENT_GAIN:
+        if (event->target >= 0)
+            first = last = event->target;
+        for (c = first; c <= last; c++) {
+            if (event->duration) {
+                self->gainStep[c] = (event->value - self->gain[c]) /
+                                    event->duration;
+                self->gainRemaining[c] = event->duration;
+            } else {
+                self->gain[c] = event->value;
+                self->gainRemaining[c] = 0;
+            }
+        }
+        break;
+    case EVENT_STOP:
+        for (c = 0; c <= last; c++) {
+            /* keep where a ramp was heading rather than where it got to */
+            if (!self->stopping)
+                self->stopGain[c] = self->gain[c] +
+                                    self->gainStep[c] * self->gainRemaining[c];
+            self->gain[c] = 0.0;
+            self->gainRemaining[c] = 0;
+        }
+        self->stopping = 1;
+        break;
+    case EVENT_TRIGGER:
+        start_voice(self, event->target, event->value);
+        break;
+    }
+}
+
+/* Undo a scheduled stop so that a restarted stream is heard again. Must only
+ * be called while the stream is stopped. */
+static void rewind_events(Stream *self) {
+    int c;
+    if (self->stopping) {
+        for (c = 0; c < self->numOutputChannels; c++)
+            self->gain[c] = self->stopGain[c];
+    }
+    self->stopping = 0;
+    self->finishing = 0;
+}
+
+/* Move newly scheduled events into the pending list, resolving stream times
+ * against the timestamp of the current buffer. The list is sorted latest
+ * first, and events with the same frame run in the order they were queued. */
+static void dequeue_events(Stream *self,
+                           const PaStreamCallbackTimeInfo *timeInfo) {
+    unsigned int head = ATOMIC_LOAD(&self->queueHead);
+    unsigned int tail = self->queueTail;
+
+    while (tail != head && self->pendingCount < EVENT_QUEUE_SIZE) {
+        Event event = self->queue[tail & (EVENT_QUEUE_SIZE - 1)];
+        int i;
+        if (!event.byFrame) {
+            double offset = (event.time - timeInfo->outputBufferDacTime) *
+                            self->sampleRate;
+            event.frame = self->frame +
+                          (long long)(offset < 0.0 ? offset - 0.5 : offset + 0.5);
+        }
+        for (i = self->pendingCount;
+             i > 0 && self->pending[i - 1].frame <= event.frame; i--)
+            self->pending[i] = self->pending[i - 1];
+        self->pending[i] = event;
+        self->pendingCount++;
+        tail++;
+    }
+    ATOMIC_STORE(&self->queueTail, tail);
+}
+
+static void apply_gain(Stream *self, void *outputBuffer, unsigned long start,
+                       unsigned long end) {
+    PaSampleFormat format = self->sampleFormat;
+    int c, channels = self->numOutputChannels, unity = 1;
+    unsigned long i, ramped = start;
+
+    for (c = 0; c < channels; c++) {
+        unsigned long rampEnd = start + self->gainRemaining[c];
+        if (rampEnd > end)
+            rampEnd = end;
+        if (rampEnd > ramped)
+            ramped = rampEnd;
+    }
+
+    /* until every ramp in this segment has finished, step sample by sample */
+    for (c = 0; c < channels; c++) {
+        for (i = start; i < ramped; i++) {
+            unsigned long index = i * channels + c;
+            if (self->gainRemaining[c]) {
+                self->gain[c] += self->gainStep[c];
+                self->gainRemaining[c]--;
+            } else if (self->gain[c] == 1.0) {
+                continue;
+            }
+            write_sample(format, outputBuffer, index, self->gain[c] *
+                         read_sample(format, outputBuffer, index));
+        }
+        if (self->gain[c] != 1.0)
+            unity = 0;
+    }
+
+    if (ramped < end && !unity)
+        self->scale((char*)outputBuffer + ramped * channels * self->sampleSize,
+                    self->gain, end - ramped, channels);
+}
+
+/* Run the events that fall within this buffer at their exact frame offsets
+ * and apply the resulting gain to the output. Runs on the audio thread. */
+static int run_events(Stream *self, void *outputBuffer,
+                      unsigned long framesPerBuffer,
+                      const PaStreamCallbackTimeInfo *timeInfo, int result) {
+    unsigned long start = 0, end;
+
+    dequeue_events(self, timeInfo);
+    while (start < framesPerBuffer) {
+        while (self->pendingCount && self->pending[self->pendingCount - 1].frame
+                                     <= self->frame + (long long)start) {
+            apply_event(self, &self->pending[self->pendingCount - 1]);
+            self->pendingCount--;
+        }
+        end = framesPerBuffer;
+        if (self->pendingCount) {
+            long long next = self->pending[self->pendingCount - 1].frame -
+                             self->frame;
+            if (next < (long long)end)
+                end = (unsigned long)next;
+        }
+        if (outputBuffer && self->sampleCount &&
+                framesPerBuffer <= self->framesPerBuffer)
+            mix_voices(self, outputBuffer, start, end);
+        if (outputBuffer)
+            apply_gain(self, outputBuffer, start, end);
+        start = end;
+    }
+    ATOMIC_STORE(&self->frame, self->frame + (long long)framesPerBuffer);
+
+    if (self->stopping && result == paContinue)
+        return paComplete;
+    return result;
+}
+
+/* Open the PortAudio stream for the current frames_per_buffer and
+ * suggested latency. May be called without the GIL. */
+static PaError open_stream(Stream *self) {
+    PaStreamParameters input, output;
+    PaStream *stream;
+    PaError err;
+
+    if (self->suggestedLatency <= 0.0) {
+        err = Pa_OpenDefaultStream(&stream, self->numInputChannels,
+                                   self->numOutputChannels, self->sampleFormat,
+                                   self->sampleRate, self->framesPerBuffer,
+                                   paTestCallback, (void*)self);
+    } else {
+        input.device = Pa_GetDefaultInputDevice();
+        input.channelCount = self->numInputChannels;
+        input.sampleFormat = self->sampleFormat;
+        input.suggestedLatency = self->suggestedLatency;
+        input.hostApiSpecificStreamInfo = NULL;
+        output = input;
+        output.device = Pa_GetDefaultOutputDevice();
+        output.channelCount = self->numOutputChannels;
+        err = Pa_OpenStream(&stream,
+                            self->numInputChannels ? &input : NULL,
+                            self->numOutputChannels ? &output : NULL,
+                            self->sampleRate, self->framesPerBuffer, paNoFlag,
+                            paTestCallback, (void*)self);
+    }
+    if (err == paNoError)
+        self->stream = stream;
+    return err;
+}
+
 static void Stream_dealloc(Stream* self) {
-    Py_XDECREF(self->stream);
+    self->deallocating = 1;
+    if (self->stream) {
+        Py_BEGIN_ALLOW_THREADS
+        close_stream(self);
+        Py_END_ALLOW_THREADS
+    }
+    pthread_mutex_destroy(&self->mutex);
+    pthread_cond_destroy(&self->cond);
+    PyMem_Free(self->jobInput);
+    PyMem_Free(self->jobOutput);
+    PyMem_Free(self->lastOutput);
+    PyMem_Free(self->gain);
+    PyMem_Free(self->gainStep);
+    PyMem_Free(self->gainRemaining);
+    PyMem_Free(self->stopGain);
+    PyMem_Free(self->routeInput);
+    PyMem_Free(self->routeOutput);
+    PyMem_Free(self->routeParam);
+    PyMem_Free(self->routeGain);
+    PyMem_Free(self->mixInput);
+    PyMem_Free(self->mix);
+    PyMem_Free(self->ring);
+    PyMem_Free(self->voiceMix);
+    PyMem_Free(self->voiceInput);
+    int i;
+    for (i = 0; i < self->sampleCount; i++)
+        free(self->samples[i].data);
+    Py_XDECREF(self->callback);
+    Py_XDECREF(self->userData);
+    Py_XDECREF(self->errorType);
+    Py_XDECREF(self->errorValue);
+    Py_XDECREF(self->errorTraceback);
     self->ob_type->tp_free((PyObject*)self);
 }
 
@@ -21,11 +1171,14 @@ static PyObject *Stream_close(Stream *self, PyObject *args) {
         return NULL;
 
     PaError err;
-    err = Pa_CloseStream(self->stream);
+    Py_BEGIN_ALLOW_THREADS
+    err = close_stream(self);
+    Py_END_ALLOW_THREADS
     if (err != paNoError) {
         PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
         return NULL;
     }
+    self->stream = NULL;
 
     Py_INCREF(Py_None);
     return Py_None;
@@ -35,9 +1188,25 @@ static PyObject *Stream_start(Stream *self, PyObject *args) {
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
 
+    int startedWorker = 0;
+    if ((self->budget > 0.0 || (self->routeCount && self->decimation)) &&
+            !self->workerRunning) {
+        if (start_worker(self) < 0)
+            return NULL;
+        startedWorker = 1;
+    }
+    if (Pa_IsStreamStopped(self->stream) == 1)
+        rewind_events(self);
+
     PaError err;
     err = Pa_StartStream(self->stream);
     if (err != paNoError) {
+        /* leave the worker of an already running stream alone */
+        if (startedWorker) {
+            Py_BEGIN_ALLOW_THREADS
+            stop_worker(self);
+            Py_END_ALLOW_THREADS
+        }
         PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
         return NULL;
     }
@@ -51,92 +1220,644 @@ static PyObject *Stream_stop(Stream *self, PyObject *args) {
         return NULL;
 
     PaError err;
+    Py_BEGIN_ALLOW_THREADS
     err = Pa_StopStream(self->stream);
+    if (err == paNoError)
+        stop_worker(self);
+    Py_END_ALLOW_THREADS
     if (err != paNoError) {
         PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
         return NULL;
-    }
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *Stream_abort(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    PaError err;
+    Py_BEGIN_ALLOW_THREADS
+    err = Pa_AbortStream(self->stream);
+    if (err == paNoError)
+        stop_worker(self);
+    Py_END_ALLOW_THREADS
+    if (err != paNoError) {
+        PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *Stream_is_active(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    PaError err = Pa_IsStreamActive(self->stream);
+    if (err == 1) {
+        Py_INCREF(Py_True);
+        return Py_True;
+    } else if (err == paNoError) {
+        Py_INCREF(Py_False);
+        return Py_False;
+    } else {
+        PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+        return NULL;
+    }
+}
+
+static PyObject *Stream_is_stopped(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    PaError err = Pa_IsStreamStopped(self->stream);
+    if (err == 1) {
+        Py_INCREF(Py_True);
+        return Py_True;
+    } else if (err == paNoError) {
+        Py_INCREF(Py_False);
+        return Py_False;
+    } else {
+        PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+        return NULL;
+    }
+}
+
+static PyObject *Stream_get_time(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    PyObject *result = PyFloat_FromDouble(Pa_GetStreamTime(self->stream));
+    Py_INCREF(result);
+    return result;
+}
+
+static PyObject *Stream_get_cpu_load(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    PyObject *result = PyFloat_FromDouble(Pa_GetStreamCpuLoad(self->stream));
+    Py_INCREF(result);
+    return result;
+}
+
+static PyObject *Stream_get_info(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    const PaStreamInfo *info = Pa_GetStreamInfo(self->stream);
+    PyObject *result = Py_BuildValue("fff", info->inputLatency,
+                                     info->outputLatency, info->sampleRate);
+    Py_INCREF(result);
+    return result;
+}
+
+static int check_stopped(Stream *self) {
+    if (self->workerRunning || Pa_IsStreamStopped(self->stream) != 1) {
+        PyErr_SetString(PortAudioError, Pa_GetErrorText(paStreamIsNotStopped));
+        return -1;
+    }
+    return 0;
+}
+
+static int alloc_job_buffers(Stream *self) {
+    size_t size = self->framesPerBuffer * self->sampleSize;
+    if (self->jobOutput)
+        return 0;
+    self->jobInput = PyMem_Malloc(size * self->numInputChannels + 1);
+    self->jobOutput = PyMem_Malloc(size * self->numOutputChannels + 1);
+    self->lastOutput = PyMem_Malloc(size * self->numOutputChannels + 1);
+    if (!self->jobInput || !self->jobOutput || !self->lastOutput) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static int alloc_passthrough_buffers(Stream *self) {
+    if (self->mix)
+        return 0;
+    self->ringSize = self->framesPerBuffer * SIDECHAIN_BUFFERS + 1;
+    self->mixInput = PyMem_New(double, self->framesPerBuffer *
+                               self->numInputChannels + 1);
+    self->mix = PyMem_New(double, self->framesPerBuffer *
+                          self->numOutputChannels + 1);
+    self->ring = PyMem_Malloc(self->ringSize * self->numInputChannels *
+                              self->sampleSize + 1);
+    if (!self->mixInput || !self->mix || !self->ring) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static int alloc_voice_buffers(Stream *self) {
+    if (self->voiceMix)
+        return 0;
+    self->voiceMix = PyMem_New(double, self->framesPerBuffer *
+                               self->numOutputChannels + 1);
+    self->voiceInput = PyMem_New(double, self->framesPerBuffer *
+                                 self->numOutputChannels + 1);
+    if (!self->voiceMix || !self->voiceInput) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+/* Reallocate the scratch buffers in use after frames_per_buffer changes. */
+static int resize_buffers(Stream *self) {
+    int job = self->jobOutput != NULL, passthrough = self->mix != NULL;
+    int voice = self->voiceMix != NULL;
+
+    PyMem_Free(self->jobInput);
+    PyMem_Free(self->jobOutput);
+    PyMem_Free(self->lastOutput);
+    PyMem_Free(self->mixInput);
+    PyMem_Free(self->mix);
+    PyMem_Free(self->ring);
+    PyMem_Free(self->voiceMix);
+    PyMem_Free(self->voiceInput);
+    self->jobInput = self->jobOutput = self->lastOutput = NULL;
+    self->mixInput = self->mix = NULL;
+    self->ring = NULL;
+    self->voiceMix = self->voiceInput = NULL;
+
+    if (job && alloc_job_buffers(self) < 0)
+        return -1;
+    if (passthrough && alloc_passthrough_buffers(self) < 0)
+        return -1;
+    if (voice && alloc_voice_buffers(self) < 0)
+        return -1;
+    return 0;
+}
+
+static PyObject *Stream_set_deadline(Stream *self, PyObject *args) {
+    double budget;
+    int concealment = CONCEAL_SILENCE;
+    if (!PyArg_ParseTuple(args, "d|i", &budget, &concealment))
+        return NULL;
+
+    if (budget > 1.0 || concealment < CONCEAL_SILENCE ||
+            concealment > CONCEAL_CROSSFADE) {
+        PyErr_SetString(PyExc_ValueError, "invalid deadline parameters");
+        return NULL;
+    }
+    if (budget > 0.0 && self->framesPerBuffer == paFramesPerBufferUnspecified) {
+        PyErr_SetString(PortAudioError,
+                        "deadline mode requires a fixed frames_per_buffer");
+        return NULL;
+    }
+    if (budget > 0.0 && self->routeCount) {
+        PyErr_SetString(PortAudioError,
+                        "deadline mode cannot be used with passthrough");
+        return NULL;
+    }
+    if (check_stopped(self) < 0)
+        return NULL;
+
+    if (budget > 0.0 && alloc_job_buffers(self) < 0)
+        return NULL;
+    self->budget = budget > 0.0 ? budget : 0.0;
+    self->concealment = concealment;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *Stream_get_miss_count(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    return PyInt_FromLong(ATOMIC_LOAD(&self->missCount));
+}
+
+/* Look up a parameter by name or index. */
+static int find_param(Stream *self, PyObject *key) {
+    int i;
+
+    if (PyString_Check(key)) {
+        for (i = 0; i < self->paramCount; i++)
+            if (!strcmp(self->params[i].name, PyString_AS_STRING(key)))
+                return i;
+        PyErr_SetObject(PyExc_KeyError, key);
+        return -1;
+    }
+    i = (int)PyInt_AsLong(key);
+    if (i == -1 && PyErr_Occurred())
+        return -1;
+    if (i < 0 || i >= self->paramCount) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return -1;
+    }
+    return i;
+}
+
+static PyObject *Stream_define_param(Stream *self, PyObject *args) {
+    const char *name;
+    PyObject *initial;
+    unsigned long smoothing = 0;
+    if (!PyArg_ParseTuple(args, "sO|k", &name, &initial, &smoothing))
+        return NULL;
+
+    int i, isInt = PyInt_Check(initial) || PyLong_Check(initial);
+    double value = PyFloat_AsDouble(initial);
+    if (value == -1.0 && PyErr_Occurred())
+        return NULL;
+    if (strlen(name) >= MAX_PARAM_NAME) {
+        PyErr_SetString(PyExc_ValueError, "parameter name is too long");
+        return NULL;
+    }
+    for (i = 0; i < self->paramCount; i++) {
+        if (!strcmp(self->params[i].name, name)) {
+            PyErr_SetString(PyExc_ValueError, "parameter is already defined");
+            return NULL;
+        }
+    }
+    if (self->paramCount >= MAX_PARAMS) {
+        PyErr_SetString(PortAudioError, "parameter block is full");
+        return NULL;
+    }
+
+    Param *param = &self->params[self->paramCount];
+    strcpy(param->name, name);
+    param->isInt = isInt;
+    param->smoothing = isInt ? 0 : smoothing;
+    param->target = param->value = param->rampTarget = value;
+    param->remaining = 0;
+    self->paramValues[self->paramCount] = value;
+    ATOMIC_STORE(&self->paramCount, self->paramCount + 1);
+
+    return PyInt_FromLong(self->paramCount - 1);
+}
+
+static PyObject *Stream_set_param(Stream *self, PyObject *args) {
+    PyObject *key;
+    double value;
+    if (!PyArg_ParseTuple(args, "Od", &key, &value))
+        return NULL;
+
+    int i = find_param(self, key);
+    if (i < 0)
+        return NULL;
+    if (self->params[i].isInt)
+        value = (double)ROUND(value);
+    ATOMIC_STORE_DOUBLE(&self->params[i].target, &value);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *Stream_get_param(Stream *self, PyObject *args) {
+    PyObject *key;
+    if (!PyArg_ParseTuple(args, "O", &key))
+        return NULL;
+
+    int i = find_param(self, key);
+    if (i < 0)
+        return NULL;
+    double value;
+    ATOMIC_LOAD_DOUBLE(&self->paramValues[i], &value);
+    if (self->params[i].isInt)
+        return PyInt_FromLong((long)value);
+    return PyFloat_FromDouble(value);
+}
+
+static PyObject *Stream_get_param_view(Stream *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    return PyBuffer_FromObject((PyObject*)self, 0, Py_END_OF_BUFFER);
+}
+
+static PyObject *Stream_set_passthrough(Stream *self, PyObject *args) {
+    PyObject *routes;
+    int decimation = 1;
+    if (!PyArg_ParseTuple(args, "O|i", &routes, &decimation))
+        return NULL;
+
+    if (routes == Py_None)
+        routes = PyList_New(0);
+    else
+        routes = PySequence_Fast(routes, "routes must be a sequence");
+    if (!routes)
+        return NULL;
+
+    int i, count = PySequence_Fast_GET_SIZE(routes);
+    int *input = PyMem_New(int, count + 1), *output = PyMem_New(int, count + 1);
+    int *param = PyMem_New(int, count + 1);
+    double *gain = PyMem_New(double, count + 1);
+    if (!input || !output || !param || !gain) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (i = 0; i < count; i++) {
+        PyObject *gainObject;
+        if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(routes, i), "iiO",
+                              &input[i], &output[i], &gainObject))
+            goto error;
+        param[i] = -1;
+        gain[i] = 0.0;
+        if (PyString_Check(gainObject)) {
+            param[i] = find_param(self, gainObject);
+            if (param[i] < 0)
+                goto error;
+        } else {
+            gain[i] = PyFloat_AsDouble(gainObject);
+            if (gain[i] == -1.0 && PyErr_Occurred())
+                goto error;
+        }
+        if (input[i] < 0 || input[i] >= self->numInputChannels ||
+                output[i] < 0 || output[i] >= self->numOutputChannels) {
+            PyErr_SetString(PyExc_ValueError, "invalid channel in route");
+            goto error;
+        }
+    }
+    if (decimation < 0) {
+        PyErr_SetString(PyExc_ValueError, "invalid decimation");
+        goto error;
+    }
+    if (count && self->framesPerBuffer == paFramesPerBufferUnspecified) {
+        PyErr_SetString(PortAudioError,
+                        "passthrough requires a fixed frames_per_buffer");
+        goto error;
+    }
+    if (count && self->budget > 0.0) {
+        PyErr_SetString(PortAudioError,
+                        "passthrough cannot be used with deadline mode");
+        goto error;
+    }
+    if (check_stopped(self) < 0)
+        goto error;
+
+    if (count && (alloc_passthrough_buffers(self) < 0 ||
+                  alloc_job_buffers(self) < 0))
+        goto error;
+
+    PyMem_Free(self->routeInput);
+    PyMem_Free(self->routeOutput);
+    PyMem_Free(self->routeParam);
+    PyMem_Free(self->routeGain);
+    self->routeInput = input;
+    self->routeOutput = output;
+    self->routeParam = param;
+    self->routeGain = gain;
+    self->routeCount = count;
+    self->decimation = decimation;
+    Py_DECREF(routes);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+
+error:
+    PyMem_Free(input);
+    PyMem_Free(output);
+    PyMem_Free(param);
+    PyMem_Free(gain);
+    Py_DECREF(routes);
+    return NULL;
+}
+
+/* Add an event to the queue read by the audio thread. Must be called with
+ * the GIL held, which makes Python the only writer. */
+static int push_event(Stream *self, const Event *event) {
+    unsigned int head = self->queueHead;
+    if (head - ATOMIC_LOAD(&self->queueTail) >= EVENT_QUEUE_SIZE) {
+        PyErr_SetString(PortAudioError, "event queue is full");
+        return -1;
+    }
+    self->queue[head & (EVENT_QUEUE_SIZE - 1)] = *event;
+    ATOMIC_STORE(&self->queueHead, head + 1);
+    return 0;
+}
+
+static PyObject *Stream_schedule(Stream *self, PyObject *args) {
+    PyObject *when;
+    Event event;
+    event.duration = 0;
+    event.target = -1;
+    if (!PyArg_ParseTuple(args, "Oid|ki", &when, &event.type, &event.value,
+                          &event.duration, &event.target))
+        return NULL;
+
+    if (PyInt_Check(when) || PyLong_Check(when)) {
+        event.byFrame = 1;
+        event.frame = PyLong_AsLongLong(when);
+        if (event.frame == -1 && PyErr_Occurred())
+            return NULL;
+    } else {
+        event.byFrame = 0;
+        event.time = PyFloat_AsDouble(when);
+        if (event.time == -1.0 && PyErr_Occurred())
+            return NULL;
+    }
+    if (event.type < EVENT_GAIN || event.type > EVENT_TRIGGER ||
+            (event.type == EVENT_GAIN && (event.target < -1 ||
+             event.target >= self->numOutputChannels)) ||
+            (event.type == EVENT_TRIGGER && (event.target < 0 ||
+             event.target >= self->sampleCount))) {
+        PyErr_SetString(PyExc_ValueError, "invalid event");
+        return NULL;
+    }
+
+    if (push_event(self, &event) < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *Stream_load_sample(Stream *self, PyObject *args) {
+    const void *data;
+    int size;
+    if (!PyArg_ParseTuple(args, "s#", &data, &size))
+        return NULL;
+
+    size_t frameSize = self->numOutputChannels * self->sampleSize;
+    if (!frameSize || (size_t)size % frameSize) {
+        PyErr_SetString(PyExc_ValueError,
+                        "sample data must be a whole number of output frames");
+        return NULL;
+    }
+    if (self->framesPerBuffer == paFramesPerBufferUnspecified) {
+        PyErr_SetString(PortAudioError,
+                        "samples require a fixed frames_per_buffer");
+        return NULL;
+    }
+    if (self->sampleCount >= MAX_SAMPLES) {
+        PyErr_SetString(PortAudioError, "sample bank is full");
+        return NULL;
+    }
+
+    if (alloc_voice_buffers(self) < 0)
+        return NULL;
 
-    Py_INCREF(Py_None);
-    return Py_None;
+    Sample *sample = &self->samples[self->sampleCount];
+    if (posix_memalign(&sample->data, SAMPLE_ALIGNMENT, size + 1))
+        return PyErr_NoMemory();
+    memcpy(sample->data, data, size);
+    sample->frames = size / frameSize;
+    ATOMIC_STORE(&self->sampleCount, self->sampleCount + 1);
+
+    return PyInt_FromLong(self->sampleCount - 1);
 }
 
-static PyObject *Stream_abort(Stream *self, PyObject *args) {
-    if (!PyArg_ParseTuple(args, ""))
+static PyObject *Stream_trigger(Stream *self, PyObject *args) {
+    Event event;
+    event.type = EVENT_TRIGGER;
+    event.value = 1.0;
+    event.byFrame = 1;
+    event.frame = 0;
+    event.duration = 0;
+    if (!PyArg_ParseTuple(args, "i|d", &event.target, &event.value))
         return NULL;
 
-    PaError err;
-    err = Pa_AbortStream(self->stream);
-    if (err != paNoError) {
-        PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+    if (event.target < 0 || event.target >= self->sampleCount) {
+        PyErr_SetString(PyExc_ValueError, "invalid sample");
         return NULL;
     }
 
+    if (push_event(self, &event) < 0)
+        return NULL;
+
     Py_INCREF(Py_None);
     return Py_None;
 }
 
-static PyObject *Stream_is_active(Stream *self, PyObject *args) {
+static PyObject *Stream_get_frame(Stream *self, PyObject *args) {
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
 
-    PaError err = Pa_IsStreamActive(self->stream);
-    if (err == 1) {
-        Py_INCREF(Py_True);
-        return Py_True;
-    } else if (err == paNoError) {
-        Py_INCREF(Py_False);
-        return Py_False;
-    } else {
+    return PyLong_FromLongLong(ATOMIC_LOAD(&self->frame));
+}
+
+/* Reopen the stream with a new buffer size, restarting it if it was
+ * running. Falls back to the old configuration if the new one is refused. */
+static int reopen_stream(Stream *self, unsigned long framesPerBuffer) {
+    unsigned long oldFrames = self->framesPerBuffer;
+    double oldLatency = self->suggestedLatency;
+    /* a stream that finished on its own is not stopped, but is not running
+     * either */
+    int running = Pa_IsStreamActive(self->stream) == 1;
+    PaError err;
+
+    Py_BEGIN_ALLOW_THREADS
+    close_stream(self);
+    self->stream = NULL;
+    self->framesPerBuffer = framesPerBuffer;
+    self->suggestedLatency = TUNE_LATENCY_BUFFERS * framesPerBuffer /
+                             self->sampleRate;
+    err = open_stream(self);
+    if (err != paNoError) {
+        self->framesPerBuffer = oldFrames;
+        self->suggestedLatency = oldLatency;
+        open_stream(self);
+    }
+    Py_END_ALLOW_THREADS
+
+    if (!self->stream || resize_buffers(self) < 0) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+        return -1;
+    }
+    if (running) {
+        if ((self->budget > 0.0 || (self->routeCount && self->decimation)) &&
+                start_worker(self) < 0)
+            return -1;
+        PaError startErr = Pa_StartStream(self->stream);
+        if (startErr != paNoError) {
+            PyErr_SetString(PortAudioError, Pa_GetErrorText(startErr));
+            return -1;
+        }
+    }
+    if (err != paNoError) {
         PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
-        return NULL;
+        return -1;
     }
+    return 0;
 }
 
-static PyObject *Stream_is_stopped(Stream *self, PyObject *args) {
-    if (!PyArg_ParseTuple(args, ""))
+static PyObject *Stream_set_tuning(Stream *self, PyObject *args) {
+    unsigned long minFrames, maxFrames;
+    if (!PyArg_ParseTuple(args, "kk", &minFrames, &maxFrames))
         return NULL;
 
-    PaError err = Pa_IsStreamStopped(self->stream);
-    if (err == 1) {
-        Py_INCREF(Py_True);
-        return Py_True;
-    } else if (err == paNoError) {
-        Py_INCREF(Py_False);
-        return Py_False;
-    } else {
-        PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+    if (!minFrames) {
+        self->tuning = 0;
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+    if (maxFrames < minFrames) {
+        PyErr_SetString(PyExc_ValueError, "invalid buffer size range");
         return NULL;
     }
-}
-
-static PyObject *Stream_get_time(Stream *self, PyObject *args) {
-    if (!PyArg_ParseTuple(args, ""))
+    if (check_stopped(self) < 0 || reopen_stream(self, minFrames) < 0)
         return NULL;
 
-    PyObject *result = PyFloat_FromDouble(Pa_GetStreamTime(self->stream));
-    Py_INCREF(result);
-    return result;
+    self->tuneMin = minFrames;
+    self->tuneMax = maxFrames;
+    self->tuneFloor = 0;
+    self->tuneSettled = 0;
+    self->tuneBuffers = self->tuneUnderflows = self->tuneQuiet = 0;
+    self->tuneMisses = ATOMIC_LOAD(&self->missCount);
+    self->tuneLoad = 0.0;
+    self->tuning = 1;
+
+    Py_INCREF(Py_None);
+    return Py_None;
 }
 
-static PyObject *Stream_get_cpu_load(Stream *self, PyObject *args) {
+static PyObject *Stream_tune(Stream *self, PyObject *args) {
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
 
-    PyObject *result = PyFloat_FromDouble(Pa_GetStreamCpuLoad(self->stream));
-    Py_INCREF(result);
-    return result;
-}
-
-static PyObject *Stream_get_info(Stream *self, PyObject *args) {
-    if (!PyArg_ParseTuple(args, ""))
+    if (!self->tuning) {
+        PyErr_SetString(PortAudioError, "tuning is not enabled");
         return NULL;
+    }
 
-    const PaStreamInfo *info = Pa_GetStreamInfo(self->stream);
-    PyObject *result = Py_BuildValue("fff", info->inputLatency,
-                                     info->outputLatency, info->sampleRate);
-    Py_INCREF(result);
-    return result;
+    long buffers = __atomic_exchange_n(&self->tuneBuffers, 0, __ATOMIC_ACQ_REL);
+    long underflows = __atomic_exchange_n(&self->tuneUnderflows, 0,
+                                          __ATOMIC_ACQ_REL);
+    long misses = ATOMIC_LOAD(&self->missCount);
+    double load, zero = 0.0;
+    __atomic_exchange(&self->tuneLoad, &zero, &load, __ATOMIC_ACQ_REL);
+    if (buffers)
+        load /= buffers;
+    double cpuLoad = Pa_GetStreamCpuLoad(self->stream);
+    unsigned long frames = self->framesPerBuffer, next = frames;
+
+    /* in passthrough mode misses are side-chain input dropped by a slow
+     * callback, which a bigger buffer would not help the monitored signal */
+    if (underflows || (!self->routeCount && misses != self->tuneMisses) ||
+            load > TUNE_HIGH_LOAD || cpuLoad > TUNE_HIGH_LOAD) {
+        /* never come back down to a size that failed */
+        self->tuneFloor = frames;
+        next = CLAMP(frames * 2, self->tuneMin, self->tuneMax);
+        self->tuneSettled = next == frames;
+        self->tuneQuiet = 0;
+    } else if ((self->tuneQuiet += buffers) >= TUNE_BUFFERS) {
+        if (load < TUNE_LOW_LOAD && cpuLoad < TUNE_LOW_LOAD &&
+                frames / 2 >= self->tuneMin && frames / 2 > self->tuneFloor)
+            next = frames / 2;
+        else
+            self->tuneSettled = 1;
+    }
+    self->tuneMisses = misses;
+
+    if (next != frames) {
+        self->tuneSettled = 0;
+        self->tuneQuiet = 0;
+        if (reopen_stream(self, next) < 0)
+            return NULL;
+    }
+
+    return Py_BuildValue("kdO", self->framesPerBuffer, self->suggestedLatency,
+                         self->tuneSettled ? Py_True : Py_False);
 }
 
 static PyMethodDef Stream_methods[] = {
@@ -218,9 +1939,152 @@ static PyMethodDef Stream_methods[] = {
      "    to open_stream(). If information about the actual hardware\n"
      "    sample rate is not available, this field will have the same\n"
      "    value as the sample rate parameter passed to open_stream()."},
+    {"set_deadline", (PyCFunction)Stream_set_deadline, METH_VARARGS,
+     "stream.set_deadline(budget[, concealment])\n\n"
+     "Enable deadline mode. The stream callback is run on a separate\n"
+     "thread, and the audio thread waits at most 'budget' (a fraction of\n"
+     "the buffer period between 0.0 and 1.0) for it to return. If the\n"
+     "callback misses its deadline or raises an exception, the buffer is\n"
+     "filled according to 'concealment', the stream keeps running, and\n"
+     "the event is counted by stream.get_miss_count(). A late buffer is\n"
+     "discarded. 'concealment' is one of portaudio.CONCEAL_SILENCE (fade\n"
+     "to silence, the default), portaudio.CONCEAL_REPEAT (repeat the\n"
+     "last buffer), or portaudio.CONCEAL_CROSSFADE (repeat the last\n"
+     "buffer, crossfading over the seam). A budget of 0.0 disables\n"
+     "deadline mode. The stream must be stopped. May raise\n"
+     "portaudio.Error."},
+    {"get_miss_count", (PyCFunction)Stream_get_miss_count, METH_VARARGS,
+     "stream.get_miss_count() -> int\n\n"
+     "Return the number of buffers that were concealed because the stream\n"
+     "callback missed its deadline or raised an exception, or that were\n"
+     "dropped from the passthrough side-chain."},
+    {"set_passthrough", (PyCFunction)Stream_set_passthrough, METH_VARARGS,
+     "stream.set_passthrough(routes[, decimation])\n\n"
+     "Route input directly to output without calling Python on the\n"
+     "audio thread. 'routes' is a sequence of (input_channel,\n"
+     "output_channel, gain) tuples; routes to the same output channel\n"
+     "are mixed. 'gain' may be the name of a parameter from\n"
+     "stream.define_param() to follow its value sample by sample.\n"
+     "Every 'decimation'th input frame (every frame by default) is\n"
+     "buffered and passed to the stream callback on a separate thread\n"
+     "as its input list, so a slow callback can never delay the\n"
+     "monitored signal; its output list is ignored. Input that arrives\n"
+     "while the buffer is full is dropped and counted by\n"
+     "stream.get_miss_count(). A decimation of 0 disables the callback\n"
+     "entirely, and a routes value of None or [] disables passthrough.\n"
+     "The stream must be stopped. May raise portaudio.Error."},
+    {"define_param", (PyCFunction)Stream_define_param, METH_VARARGS,
+     "stream.define_param(name, value[, smoothing]) -> int\n\n"
+     "Add a parameter to the stream's parameter block and return its\n"
+     "index. The parameter is an int if 'value' is an int, and a float\n"
+     "otherwise. When a float parameter is set, the audio thread moves it\n"
+     "linearly to the new value over 'smoothing' frames (0, the default,\n"
+     "for an immediate change). May raise portaudio.Error if the block\n"
+     "is full."},
+    {"set_param", (PyCFunction)Stream_set_param, METH_VARARGS,
+     "stream.set_param(param, value)\n\n"
+     "Set a parameter, given by name or index, without waiting for the\n"
+     "audio thread. The new value takes effect at the start of the next\n"
+     "buffer."},
+    {"get_param", (PyCFunction)Stream_get_param, METH_VARARGS,
+     "stream.get_param(param) -> int or float\n\n"
+     "Return the value of a parameter, given by name or index, as of the\n"
+     "start of the current buffer, or of the last one if the stream is\n"
+     "not running, so a stream callback sees every stream.set_param()\n"
+     "made before its buffer began."},
+    {"get_param_view", (PyCFunction)Stream_get_param_view, METH_VARARGS,
+     "stream.get_param_view() -> buffer\n\n"
+     "Return a read-only buffer over the values of the parameter block,\n"
+     "as native doubles in index order, updated by the audio thread at\n"
+     "the start of every buffer. Reading it (for example with\n"
+     "struct.unpack_from('d', view, 8 * index)) is cheaper than calling\n"
+     "stream.get_param() from the stream callback."},
+    {"set_tuning", (PyCFunction)Stream_set_tuning, METH_VARARGS,
+     "stream.set_tuning(min_frames, max_frames)\n\n"
+     "Enable the latency tuner, reopening the stream with 'min_frames'\n"
+     "frames per buffer and a suggested latency of two buffers. While the\n"
+     "stream runs, call stream.tune() periodically to adjust the buffer\n"
+     "size between 'min_frames' and 'max_frames'. A 'min_frames' of 0\n"
+     "disables the tuner, keeping the current configuration. The stream\n"
+     "must be stopped. May raise portaudio.Error."},
+    {"tune", (PyCFunction)Stream_tune, METH_VARARGS,
+     "stream.tune() -> (int, float, bool)\n\n"
+     "Adjust the buffer size from what the stream did since the last\n"
+     "call. Underflows, overflows, buffers missed by the callback, or\n"
+     "processing using most of the buffer period double the buffer size;\n"
+     "input dropped by a passthrough side-chain is ignored. A long quiet\n"
+     "stretch halves it, but never back to a size that failed. Changing\n"
+     "the size reopens the stream, restarting it if it was running; the\n"
+     "reopened stream has a new clock, so any StreamGroup offsets for it\n"
+     "are no longer valid.\n"
+     "Return the frames per buffer, the suggested latency in seconds, and\n"
+     "whether the configuration has settled. Passing the first two as\n"
+     "'frames_per_buffer' and 'suggested_latency' to\n"
+     "open_default_stream() opens the stream with the same configuration\n"
+     "next time. May raise portaudio.Error."},
+    {"schedule", (PyCFunction)Stream_schedule, METH_VARARGS,
+     "stream.schedule(when, event, value[, duration[, target]])\n\n"
+     "Queue an event to be executed by the audio thread at an exact\n"
+     "sample offset. 'when' is either a frame position (an int, as\n"
+     "returned by stream.get_frame()) or a stream time in seconds (a\n"
+     "float, as returned by stream.get_time()). Events in the past are\n"
+     "executed at the start of the next buffer. 'event' is one of:\n\n"
+     "    portaudio.EVENT_GAIN : Set the output gain of channel 'target'\n"
+     "    (all channels if -1, the default) to 'value', ramping linearly\n"
+     "    over 'duration' frames (0, the default, for an immediate\n"
+     "    change).\n\n"
+     "    portaudio.EVENT_STOP : Silence the output and complete the\n"
+     "    stream at the end of the buffer, as if the stream callback had\n"
+     "    returned portaudio.COMPLETE. 'value' is ignored.\n\n"
+     "    portaudio.EVENT_TRIGGER : Play sample 'target' from the sample\n"
+     "    bank with gain 'value'; see stream.load_sample().\n\n"
+     "Samples are mixed into the output of the stream callback, and gain\n"
+     "is applied to the result. May raise portaudio.Error if the event\n"
+     "queue is full."},
+    {"load_sample", (PyCFunction)Stream_load_sample, METH_VARARGS,
+     "stream.load_sample(data) -> int\n\n"
+     "Copy 'data', a string or other buffer (such as an mmap) of\n"
+     "interleaved frames in the stream's sample format and output channel\n"
+     "count, into the stream's sample bank, and return its sample ID.\n"
+     "Samples stay loaded until the stream is destroyed. May raise\n"
+     "portaudio.Error if the bank is full."},
+    {"trigger", (PyCFunction)Stream_trigger, METH_VARARGS,
+     "stream.trigger(sample[, gain])\n\n"
+     "Play a sample from the sample bank at the start of the next buffer,\n"
+     "mixed into the stream's output by the audio thread. Up to 32\n"
+     "samples play at once; triggering another stops the one that has\n"
+     "been playing longest. May raise portaudio.Error if the event queue\n"
+     "is full."},
+    {"get_frame", (PyCFunction)Stream_get_frame, METH_VARARGS,
+     "stream.get_frame() -> int\n\n"
+     "Return the frame position of the next buffer to be processed,\n"
+     "counted from when the stream was opened."},
     {NULL},
 };
 
+static Py_ssize_t Stream_getreadbuffer(Stream *self, Py_ssize_t segment,
+                                       void **ptr) {
+    if (segment != 0) {
+        PyErr_SetString(PyExc_SystemError, "accessing non-existent segment");
+        return -1;
+    }
+    *ptr = self->paramValues;
+    return self->paramCount * sizeof(double);
+}
+
+static Py_ssize_t Stream_getsegcount(Stream *self, Py_ssize_t *lenp) {
+    if (lenp)
+        *lenp = self->paramCount * sizeof(double);
+    return 1;
+}
+
+static PyBufferProcs Stream_as_buffer = {
+    (readbufferproc)Stream_getreadbuffer, /* bf_getreadbuffer */
+    0, /* bf_getwritebuffer */
+    (segcountproc)Stream_getsegcount, /* bf_getsegcount */
+    0, /* bf_getcharbuffer */
+};
+
 static PyTypeObject StreamType = {
     PyObject_HEAD_INIT(NULL)
     0, /* ob_size */
@@ -241,7 +2105,7 @@ static PyTypeObject StreamType = {
     0, /* tp_str */
     0, /* tp_getattro */
     0, /* tp_setattro */
-    0, /* tp_as_buffer */
+    &Stream_as_buffer, /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT, /* tp_flags */
     "A single Stream can provide multiple channels of real-time\n"
     "streaming audio input and output to a client application. Depending\n"
@@ -258,152 +2122,375 @@ static PyTypeObject StreamType = {
     Stream_methods, /* tp_methods */
 };
 
-/* unexposed utility functions */
+/* stream groups */
 
-static int paTestCallback(const void *inputBuffer, void *outputBuffer,
-                          unsigned long framesPerBuffer,
-                          const PaStreamCallbackTimeInfo *timeInfo,
-                          PaStreamCallbackFlags statusFlags,
-                          void *userData) {
-    PyGILState_STATE gstate;
-    gstate = PyGILState_Ensure();
+typedef struct {
+    PyObject_HEAD
+    PyObject *streams;
+    int count;
+    double *offsets;
+    double origin;
+    /* which members had their worker started by the current group.start() */
+    int *startedWorkers;
+} StreamGroup;
+
+static double monotonic_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static Stream *get_member(StreamGroup *self, int i) {
+    return (Stream*)PyTuple_GET_ITEM(self->streams, i);
+}
+
+static void StreamGroup_dealloc(StreamGroup *self) {
+    Py_XDECREF(self->streams);
+    PyMem_Free(self->offsets);
+    PyMem_Free(self->startedWorkers);
+    self->ob_type->tp_free((PyObject*)self);
+}
+
+static PyObject *StreamGroup_start(StreamGroup *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    int i, started, ready;
+    for (i = 0; i < self->count; i++)
+        self->startedWorkers[i] = 0;
+    for (i = 0; i < self->count; i++) {
+        Stream *member = get_member(self, i);
+        if ((member->budget > 0.0 ||
+                    (member->routeCount && member->decimation)) &&
+                !member->workerRunning) {
+            if (start_worker(member) < 0)
+                break;
+            self->startedWorkers[i] = 1;
+        }
+        if (Pa_IsStreamStopped(member->stream) == 1)
+            rewind_events(member);
+    }
+    ready = i == self->count;
+
+    PaError err = paNoError;
+    double origin;
+    Py_BEGIN_ALLOW_THREADS
+    if (ready) {
+        origin = monotonic_time();
+        for (started = 0; started < self->count; started++) {
+            err = Pa_StartStream(get_member(self, started)->stream);
+            if (err != paNoError)
+                break;
+        }
+        if (err == paNoError) {
+            /* sample every clock as close together as possible; a member's
+             * offset is its stream time at the moment the group started */
+            for (i = 0; i < self->count; i++) {
+                double now = monotonic_time();
+                self->offsets[i] = Pa_GetStreamTime(
+                        get_member(self, i)->stream) - (now - origin);
+            }
+            self->origin = origin;
+        } else {
+            /* only undo what this call did; members that were already
+             * running keep running with their workers */
+            while (started--)
+                Pa_AbortStream(get_member(self, started)->stream);
+        }
+    }
+    if (!ready || err != paNoError) {
+        for (i = 0; i < self->count; i++) {
+            if (self->startedWorkers[i])
+                stop_worker(get_member(self, i));
+        }
+    }
+    Py_END_ALLOW_THREADS
+    if (!ready)
+        return NULL;
+    if (err != paNoError) {
+        PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* Stop every member with 'stop' even if one fails, raising the first
+ * error. */
+static PyObject *stop_group(StreamGroup *self, PaError (*stop)(PaStream*)) {
+    PaError err = paNoError;
+    int i;
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < self->count; i++) {
+        Stream *member = get_member(self, i);
+        PaError memberErr = stop(member->stream);
+        if (memberErr == paNoError)
+            stop_worker(member);
+        else if (err == paNoError)
+            err = memberErr;
+    }
+    Py_END_ALLOW_THREADS
+    if (err != paNoError) {
+        PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
 
-    int numInputChannels, numOutputChannels, sampleFormat;
-    PyObject *callback, *dataObject;
-    PyArg_ParseTuple(userData, "iiiOO", &numInputChannels, &numOutputChannels,
-                     &sampleFormat, &callback, &dataObject);
+static PyObject *StreamGroup_stop(StreamGroup *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    return stop_group(self, Pa_StopStream);
+}
+
+static PyObject *StreamGroup_abort(StreamGroup *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    return stop_group(self, Pa_AbortStream);
+}
+
+static PyObject *StreamGroup_get_offsets(StreamGroup *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
 
-    PyObject *inputList, *outputList;
-    inputList = PyList_New(framesPerBuffer * numInputChannels);
-    outputList = PyList_New(framesPerBuffer * numOutputChannels);
+    PyObject *offsets = PyTuple_New(self->count);
+    if (!offsets)
+        return NULL;
     int i;
-    /* check out this nasty bit of copy & paste */
-    if (sampleFormat == paFloat32) {
-        for (i = 0; i < framesPerBuffer * numInputChannels; i += 2) {
-            PyObject *value1 = PyFloat_FromDouble(((float*)inputBuffer)[i]);
-            PyList_SetItem(inputList, i, value1);
-            PyObject *value2 = PyFloat_FromDouble(((float*)inputBuffer)[i+1]);
-            PyList_SetItem(inputList, i+1, value2);
-        }
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            PyObject *value1 = PyFloat_FromDouble(((float*)outputBuffer)[i]);
-            PyList_SetItem(outputList, i, value1);
-            PyObject *value2 = PyFloat_FromDouble(((float*)outputBuffer)[i+1]);
-            PyList_SetItem(outputList, i+1, value2);
-        }
-    } else if (sampleFormat == paInt16) {
-        for (i = 0; i < framesPerBuffer * numInputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((short*)inputBuffer)[i]);
-            PyList_SetItem(inputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((short*)inputBuffer)[i+1]);
-            PyList_SetItem(inputList, i+1, value2);
-        }
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((short*)outputBuffer)[i]);
-            PyList_SetItem(outputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((short*)outputBuffer)[i+1]);
-            PyList_SetItem(outputList, i+1, value2);
-        }
-    } else if (sampleFormat == paInt32) {
-        for (i = 0; i < framesPerBuffer * numInputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((int*)inputBuffer)[i]);
-            PyList_SetItem(inputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((int*)inputBuffer)[i+1]);
-            PyList_SetItem(inputList, i+1, value2);
-        }
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((int*)outputBuffer)[i]);
-            PyList_SetItem(outputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((int*)outputBuffer)[i+1]);
-            PyList_SetItem(outputList, i+1, value2);
-        }
-    } else if (sampleFormat == paInt8) {
-        for (i = 0; i < framesPerBuffer * numInputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((char*)inputBuffer)[i]);
-            PyList_SetItem(inputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((char*)inputBuffer)[i+1]);
-            PyList_SetItem(inputList, i+1, value2);
-        }
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((char*)outputBuffer)[i]);
-            PyList_SetItem(outputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((char*)outputBuffer)[i+1]);
-            PyList_SetItem(outputList, i+1, value2);
-        }
-    } else if (sampleFormat == paUInt8) {
-        for (i = 0; i < framesPerBuffer * numInputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((unsigned char*)inputBuffer)[i]);
-            PyList_SetItem(inputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((unsigned char*)inputBuffer)[i+1]);
-            PyList_SetItem(inputList, i+1, value2);
-        }
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            PyObject *value1 = PyInt_FromLong(((unsigned char*)outputBuffer)[i]);
-            PyList_SetItem(outputList, i, value1);
-            PyObject *value2 = PyInt_FromLong(((unsigned char*)outputBuffer)[i+1]);
-            PyList_SetItem(outputList, i+1, value2);
-        }
-    }
-    /* not sure how to implement paInt24 without doing something really ugly */
-
-    PyObject *time = Py_BuildValue("fff", timeInfo->inputBufferAdcTime,
-                                   timeInfo->currentTime,
-                                   timeInfo->outputBufferDacTime);
-
-    PyObject *arglist, *py_result;
-    arglist = Py_BuildValue("OOOO", inputList, outputList, time, dataObject);
-    py_result = PyObject_CallObject(callback, arglist);
-    Py_DECREF(time);
-    Py_DECREF(arglist);
-
-    if (!py_result) {
+    for (i = 0; i < self->count; i++) {
+        PyObject *offset = PyFloat_FromDouble(self->offsets[i]);
+        if (!offset) {
+            Py_DECREF(offsets);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(offsets, i, offset);
+    }
+    return offsets;
+}
+
+static PyObject *StreamGroup_get_time(StreamGroup *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    return PyFloat_FromDouble(monotonic_time() - self->origin);
+}
+
+static PyObject *StreamGroup_get_streams(StreamGroup *self, PyObject *args) {
+    if (!PyArg_ParseTuple(args, ""))
+        return NULL;
+
+    Py_INCREF(self->streams);
+    return self->streams;
+}
+
+static PyMethodDef StreamGroup_methods[] = {
+    {"start", (PyCFunction)StreamGroup_start, METH_VARARGS,
+     "group.start()\n\n"
+     "Start every stream in the group, back to back and without holding\n"
+     "the GIL. If any stream fails to start, the ones this call started\n"
+     "are aborted and portaudio.Error is raised; streams that were\n"
+     "already running are left alone."},
+    {"stop", (PyCFunction)StreamGroup_stop, METH_VARARGS,
+     "group.stop()\n\n"
+     "Stop every stream in the group, back to back and without holding\n"
+     "the GIL, waiting until all pending audio buffers have been played.\n"
+     "Every stream is stopped even if one of them raises portaudio.Error."},
+    {"abort", (PyCFunction)StreamGroup_abort, METH_VARARGS,
+     "group.abort()\n\n"
+     "Terminate audio processing on every stream in the group\n"
+     "immediately, without waiting for pending buffers to complete."},
+    {"get_offsets", (PyCFunction)StreamGroup_get_offsets, METH_VARARGS,
+     "group.get_offsets() -> tuple of float\n\n"
+     "Return the offset in seconds of each stream's clock from the group's\n"
+     "timeline, as measured by the last group.start(). A time t on the\n"
+     "timeline is stream.get_time() == t + offset on that stream, so an\n"
+     "event scheduled with stream.schedule(t + offset, ...) on every\n"
+     "member happens at the same moment on all of them."},
+    {"get_time", (PyCFunction)StreamGroup_get_time, METH_VARARGS,
+     "group.get_time() -> float\n\n"
+     "Return the time in seconds on the group's timeline, which is zero\n"
+     "at the moment the last group.start() started the first stream."},
+    {"get_streams", (PyCFunction)StreamGroup_get_streams, METH_VARARGS,
+     "group.get_streams() -> tuple of Stream\n\n"
+     "Return the streams in the group, in the order\n"
+     "group.get_offsets() reports them."},
+    {NULL},
+};
+
+static PyTypeObject StreamGroupType = {
+    PyObject_HEAD_INIT(NULL)
+    0, /* ob_size */
+    "portaudio.StreamGroup", /* tp_name */
+    sizeof(StreamGroup), /* tp_basicsize */
+    0, /* tp_itemsize */
+    (destructor)StreamGroup_dealloc, /* tp_dealloc */
+    0, /* tp_print */
+    0, /* tp_getattr */
+    0, /* tp_setattr */
+    0, /* tp_compare */
+    0, /* tp_repr */
+    0, /* tp_as_number */
+    0, /* tp_as_sequence */
+    0, /* tp_as_mapping */
+    0, /* tp_hash */
+    0, /* tp_call */
+    0, /* tp_str */
+    0, /* tp_getattro */
+    0, /* tp_setattro */
+    0, /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT, /* tp_flags */
+    "A StreamGroup starts and stops several Streams together, possibly\n"
+    "on different devices, and relates their clocks to a common timeline\n"
+    "so that their audio can be aligned.",
+    0, /* tp_traverse */
+    0, /* tp_clear */
+    0, /* tp_richcompare */
+    0, /* tp_weaklistoffset */
+    0, /* tp_iter */
+    0, /* tp_iternext */
+    StreamGroup_methods, /* tp_methods */
+};
+
+/* unexposed utility functions */
+
+static int raise_callback_error(void *arg) {
+    Stream *self = (Stream*)arg;
+    int result = 0;
+
+    if (self->errorType) {
+        PyErr_Restore(self->errorType, self->errorValue, self->errorTraceback);
+        self->errorType = self->errorValue = self->errorTraceback = NULL;
+        result = -1;
+    }
+    Py_DECREF(self);
+    return result;
+}
+
+/* Keep the exception raised by the callback so that it can be raised in the
+ * main thread. Must be called with the GIL held and the error indicator set. */
+static void defer_callback_error(Stream *self) {
+    if (self->errorType || self->deallocating) {
+        /* one is already waiting to be raised, or there is nobody left to
+         * raise it to */
+        PyErr_PrintEx(0);
+        return;
+    }
+    PyErr_Fetch(&self->errorType, &self->errorValue, &self->errorTraceback);
+    Py_INCREF(self);
+    if (Py_AddPendingCall(raise_callback_error, self) < 0) {
+        PyErr_Restore(self->errorType, self->errorValue, self->errorTraceback);
+        self->errorType = self->errorValue = self->errorTraceback = NULL;
         PyErr_PrintEx(0);
-        Pa_Terminate();
-        exit(1);
-    }
-
-    if (sampleFormat == paFloat32) {
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            ((float*)outputBuffer)[i] =
-                (float)PyFloat_AsDouble(PyList_GetItem(outputList, i));
-            ((float*)outputBuffer)[i+1] =
-                (float)PyFloat_AsDouble(PyList_GetItem(outputList, i+1));
-        }
-    } else if (sampleFormat == paInt32) {
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            ((int*)outputBuffer)[i] =
-                (int)PyInt_AsLong(PyList_GetItem(outputList, i));
-            ((int*)outputBuffer)[i+1] =
-                (int)PyInt_AsLong(PyList_GetItem(outputList, i+1));
-        }
-    } else if (sampleFormat == paInt16) {
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            ((short*)outputBuffer)[i] =
-                (short)PyInt_AsLong(PyList_GetItem(outputList, i));
-            ((short*)outputBuffer)[i+1] =
-                (short)PyInt_AsLong(PyList_GetItem(outputList, i+1));
-        }
-    } else if (sampleFormat == paInt8) {
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            ((char*)outputBuffer)[i] =
-                (char)PyInt_AsLong(PyList_GetItem(outputList, i));
-            ((char*)outputBuffer)[i+1] =
-                (char)PyInt_AsLong(PyList_GetItem(outputList, i+1));
-        }
-    } else if (sampleFormat == paUInt8) {
-        for (i = 0; i < framesPerBuffer * numOutputChannels; i += 2) {
-            ((unsigned char*)outputBuffer)[i] =
-                (unsigned char)PyInt_AsLong(PyList_GetItem(outputList, i));
-            ((unsigned char*)outputBuffer)[i+1] =
-                (unsigned char)PyInt_AsLong(PyList_GetItem(outputList, i+1));
-        }
-    }
-
-    long result;
+        Py_DECREF(self);
+    }
+}
+
+/* Convert the buffers to lists and run the Python callback. Must be called
+ * with the GIL held. Returns -1 if the callback raised an exception. */
+static int call_callback(Stream *self, const void *inputBuffer,
+                         void *outputBuffer, unsigned long framesPerBuffer,
+                         const PaStreamCallbackTimeInfo *timeInfo,
+                         PaStreamCallbackFlags statusFlags) {
+    unsigned long numInputSamples = inputBuffer ?
+        framesPerBuffer * self->numInputChannels : 0;
+    unsigned long numOutputSamples = outputBuffer ?
+        framesPerBuffer * self->numOutputChannels : 0;
+    PyObject *inputList = NULL, *outputList = NULL, *py_result = NULL;
+    long result = -1;
+
+    inputList = self->kernels->toList(inputBuffer, numInputSamples);
+    if (!inputList)
+        goto done;
+    outputList = self->kernels->toList(outputBuffer, numOutputSamples);
+    if (!outputList)
+        goto done;
+
+    py_result = PyObject_CallFunction(self->callback, "OO(ddd)O", inputList,
+                                      outputList,
+                                      timeInfo->inputBufferAdcTime,
+                                      timeInfo->currentTime,
+                                      timeInfo->outputBufferDacTime,
+                                      self->userData);
+    if (!py_result)
+        goto done;
+
+    if (PyList_GET_SIZE(outputList) != (Py_ssize_t)numOutputSamples) {
+        PyErr_SetString(PyExc_ValueError,
+                        "stream callback changed the size of the output list");
+        goto done;
+    }
+    if (self->kernels->fromList(outputList, outputBuffer, numOutputSamples) < 0)
+        goto done;
+
     result = PyInt_AsLong(py_result);
 
-    PyGILState_Release(gstate);
+done:
+    Py_XDECREF(py_result);
+    Py_XDECREF(inputList);
+    Py_XDECREF(outputList);
+    if (result == -1 && PyErr_Occurred()) {
+        defer_callback_error(self);
+        return -1;
+    }
+
+    return result;
+}
+
+static int paTestCallback(const void *inputBuffer, void *outputBuffer,
+                          unsigned long framesPerBuffer,
+                          const PaStreamCallbackTimeInfo *timeInfo,
+                          PaStreamCallbackFlags statusFlags,
+                          void *userData) {
+    Stream *self = (Stream*)userData;
+    struct timespec started;
+    int result;
+
+    if (self->tuning)
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    begin_params(self);
+    if (self->routeCount) {
+        result = passthrough_callback(self, inputBuffer, outputBuffer,
+                                      framesPerBuffer);
+    } else if (self->budget > 0.0) {
+        result = deadline_callback(self, inputBuffer, outputBuffer,
+                                   framesPerBuffer, timeInfo, statusFlags);
+    } else {
+        PyGILState_STATE gstate;
+        gstate = PyGILState_Ensure();
+        result = call_callback(self, inputBuffer, outputBuffer,
+                               framesPerBuffer, timeInfo, statusFlags);
+        PyGILState_Release(gstate);
+
+        if (result < 0) {
+            conceal(self, outputBuffer, framesPerBuffer);
+            ATOMIC_INCREMENT(&self->missCount);
+            result = paAbort;
+        }
+    }
 
+    result = run_events(self, outputBuffer, framesPerBuffer, timeInfo, result);
+    end_params(self, framesPerBuffer);
+
+    if (self->tuning) {
+        struct timespec finished;
+        double load;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        load = ((finished.tv_sec - started.tv_sec) +
+                (finished.tv_nsec - started.tv_nsec) * 1e-9) *
+               self->sampleRate / framesPerBuffer;
+        /* a sum racing with stream.tune() only loses one buffer's load */
+        load += self->tuneLoad;
+        ATOMIC_STORE_DOUBLE(&self->tuneLoad, &load);
+        if (statusFlags & (paInputUnderflow | paInputOverflow |
+                           paOutputUnderflow | paOutputOverflow))
+            ATOMIC_INCREMENT(&self->tuneUnderflows);
+        ATOMIC_INCREMENT(&self->tuneBuffers);
+    }
     return result;
 }
 
@@ -574,6 +2661,74 @@ static PyObject *get_sample_size(PyObject *self, PyObject *args) {
     return result;
 }
 
+static PyObject *convert_samples(PyObject *self, PyObject *args) {
+    PaSampleFormat format;
+    int channels;
+    PyObject *samples, *gains = NULL;
+    if (!PyArg_ParseTuple(args, "kiO!|O", &format, &channels, &PyList_Type,
+                          &samples, &gains))
+        return NULL;
+
+    const Kernels *kernels = find_kernels(format);
+    if (!kernels) {
+        PyErr_SetString(PortAudioError,
+                        Pa_GetErrorText(paSampleFormatNotSupported));
+        return NULL;
+    }
+    unsigned long n = PyList_GET_SIZE(samples);
+    if (channels < 1 || n % channels) {
+        PyErr_SetString(PyExc_ValueError,
+                        "samples must hold a whole number of frames");
+        return NULL;
+    }
+    double *gain = PyMem_New(double, channels);
+    if (!gain)
+        return PyErr_NoMemory();
+    int c;
+    for (c = 0; c < channels; c++)
+        gain[c] = 1.0;
+    if (gains) {
+        gains = PySequence_Fast(gains, "gains must be a sequence");
+        if (!gains) {
+            PyMem_Free(gain);
+            return NULL;
+        }
+        if (PySequence_Fast_GET_SIZE(gains) != channels) {
+            Py_DECREF(gains);
+            PyMem_Free(gain);
+            PyErr_SetString(PyExc_ValueError, "need one gain per channel");
+            return NULL;
+        }
+        for (c = 0; c < channels; c++)
+            gain[c] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(gains, c));
+        Py_DECREF(gains);
+        if (PyErr_Occurred()) {
+            PyMem_Free(gain);
+            return NULL;
+        }
+    }
+
+    /* the same path a sample takes from the callback through the event
+     * scheduler and back: list -> device format -> gain -> doubles ->
+     * device format -> list */
+    PyObject *result = NULL;
+    void *buffer = PyMem_Malloc(n * Pa_GetSampleSize(format) + 1);
+    double *values = PyMem_New(double, n + 1);
+    if (!buffer || !values) {
+        PyErr_NoMemory();
+    } else if (kernels->fromList(samples, buffer, n) == 0) {
+        kernels->scale[channels <= MAX_KERNEL_CHANNELS ? channels : 0](
+                buffer, gain, n / channels, channels);
+        kernels->load(buffer, values, n);
+        kernels->store(values, buffer, n);
+        result = kernels->toList(buffer, n);
+    }
+    PyMem_Free(buffer);
+    PyMem_Free(values);
+    PyMem_Free(gain);
+    return result;
+}
+
 static PyObject *get_version(PyObject *self, PyObject *args) {
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
@@ -613,39 +2768,110 @@ static PyObject *open_default_stream(PyObject *self, PyObject *args) {
     double sampleRate;
     unsigned long framesPerBuffer;
     PyObject *callback, *userData;
-    if (!PyArg_ParseTuple(args, "iikdkOO", &numInputChannels, &numOutputChannels,
-                          &sampleFormat, &sampleRate, &framesPerBuffer,
-                          &callback, &userData))
+    double suggestedLatency = 0.0;
+    if (!PyArg_ParseTuple(args, "iikdkOO|d", &numInputChannels,
+                          &numOutputChannels, &sampleFormat, &sampleRate,
+                          &framesPerBuffer, &callback, &userData,
+                          &suggestedLatency))
         return NULL;
 
     if (!PyCallable_Check(callback)) {
         PyErr_SetString(PyExc_TypeError, "Parameter must be callable");
         return NULL;
     }
-    Py_XINCREF(callback);
-    Py_XINCREF(userData);
-
-    PyObject *backend_data = Py_BuildValue("iiiOO", numInputChannels,
-                                           numOutputChannels, sampleFormat,
-                                           callback, userData);
+    if (!find_kernels(sampleFormat)) {
+        PyErr_SetString(PortAudioError,
+                        Pa_GetErrorText(paSampleFormatNotSupported));
+        return NULL;
+    }
+    Stream *py_stream;
+    py_stream = (Stream*)StreamType.tp_alloc(&StreamType, 0);
+    if (!py_stream)
+        return NULL;
+    pthread_mutex_init(&py_stream->mutex, NULL);
+    init_cond(&py_stream->cond);
+    py_stream->numInputChannels = numInputChannels;
+    py_stream->numOutputChannels = numOutputChannels;
+    py_stream->sampleFormat = sampleFormat;
+    py_stream->sampleSize = Pa_GetSampleSize(sampleFormat);
+    py_stream->kernels = find_kernels(sampleFormat);
+    py_stream->scale = py_stream->kernels->scale[
+            numOutputChannels <= MAX_KERNEL_CHANNELS ? numOutputChannels : 0];
+    py_stream->sampleRate = sampleRate;
+    py_stream->framesPerBuffer = framesPerBuffer;
+    py_stream->suggestedLatency = suggestedLatency;
+    Py_INCREF(callback);
+    py_stream->callback = callback;
+    Py_INCREF(userData);
+    py_stream->userData = userData;
+    py_stream->gain = PyMem_New(double, numOutputChannels + 1);
+    py_stream->gainStep = PyMem_New(double, numOutputChannels + 1);
+    py_stream->gainRemaining = PyMem_New(unsigned long, numOutputChannels + 1);
+    py_stream->stopGain = PyMem_New(double, numOutputChannels + 1);
+    if (!py_stream->gain || !py_stream->gainStep ||
+            !py_stream->gainRemaining || !py_stream->stopGain) {
+        Py_DECREF(py_stream);
+        return PyErr_NoMemory();
+    }
+    int c;
+    for (c = 0; c < numOutputChannels; c++) {
+        py_stream->gain[c] = 1.0;
+        py_stream->gainRemaining[c] = 0;
+    }
 
-    PaStream *stream;
     PaError err;
-    err = Pa_OpenDefaultStream(&stream, numInputChannels, numOutputChannels,
-                               sampleFormat, sampleRate, framesPerBuffer,
-                               paTestCallback, (void*)backend_data);
+    err = open_stream(py_stream);
     if (err != paNoError) {
+        Py_DECREF(py_stream);
         PyErr_SetString(PortAudioError, Pa_GetErrorText(err));
         return NULL;
     }
-    Stream *py_stream;
-    py_stream = (Stream*)StreamType.tp_alloc(&StreamType, 0);
-    py_stream->stream = stream;
 
-    Py_INCREF(py_stream);
     return (PyObject*)py_stream;
 }
 
+static PyObject *group_streams(PyObject *self, PyObject *args) {
+    PyObject *streams;
+    if (!PyArg_ParseTuple(args, "O", &streams))
+        return NULL;
+
+    streams = PySequence_Tuple(streams);
+    if (!streams)
+        return NULL;
+    int i, count = PyTuple_GET_SIZE(streams);
+    if (!count) {
+        Py_DECREF(streams);
+        PyErr_SetString(PyExc_ValueError, "a group needs at least one stream");
+        return NULL;
+    }
+    for (i = 0; i < count; i++) {
+        if (!PyObject_TypeCheck(PyTuple_GET_ITEM(streams, i), &StreamType)) {
+            Py_DECREF(streams);
+            PyErr_SetString(PyExc_TypeError, "group members must be Streams");
+            return NULL;
+        }
+    }
+
+    StreamGroup *py_group;
+    py_group = (StreamGroup*)StreamGroupType.tp_alloc(&StreamGroupType, 0);
+    if (!py_group) {
+        Py_DECREF(streams);
+        return NULL;
+    }
+    py_group->streams = streams;
+    py_group->count = count;
+    py_group->offsets = PyMem_New(double, count);
+    py_group->startedWorkers = PyMem_New(int, count);
+    if (!py_group->offsets || !py_group->startedWorkers) {
+        Py_DECREF(py_group);
+        return PyErr_NoMemory();
+    }
+    for (i = 0; i < count; i++)
+        py_group->offsets[i] = 0.0;
+
+    return (PyObject*)py_group;
+}
+
 static PyObject *sleep_(PyObject *self, PyObject *args) {
     long msec;
     if (!PyArg_ParseTuple(args, "l", &msec))
@@ -773,8 +2999,19 @@ static PyMethodDef PortAudioMethods[] = {
     {"open_default_stream", open_default_stream, METH_VARARGS,
      "open_default_stream(num_input_channels, num_output_channels,\n"
      "                    sample_format, sample_rate, frames_per_buffer,\n"
-     "                    stream_callback, user_data) -> Stream\n\n"
-     "Open the default input and/or output devices, returning a Stream."},
+     "                    stream_callback, user_data[,\n"
+     "                    suggested_latency]) -> Stream\n\n"
+     "Open the default input and/or output devices, returning a Stream.\n"
+     "If 'suggested_latency' is given, it is the latency in seconds to\n"
+     "ask of the devices instead of their default low latency.\n"
+     "If stream_callback raises an exception, the stream is aborted and\n"
+     "the exception is raised in the main thread; see\n"
+     "stream.set_deadline() to keep the stream running instead."},
+    {"group_streams", group_streams, METH_VARARGS,
+     "group_streams(streams) -> StreamGroup\n\n"
+     "Return a StreamGroup that starts and stops the given open Streams\n"
+     "together. The streams should be stopped and should not be started\n"
+     "or stopped individually while they are grouped."},
     {"sleep", sleep_, METH_VARARGS,
      "sleep(msec)\n\n"
      "Put the caller to sleep for at least 'msec' milliseconds. This\n"
@@ -794,6 +3031,13 @@ static PyMethodDef PortAudioMethods[] = {
      "get_sample_size(format) -> int\n\n"
      "Retrive the size of a given sample format in bytes. May raise\n"
      "portaudio.Error if the format is not supported."},
+    {"convert_samples", convert_samples, METH_VARARGS,
+     "convert_samples(format, channels, samples[, gains]) -> list\n\n"
+     "Pass a list of interleaved samples through the conversions a\n"
+     "stream callback's output goes through: store them in 'format',\n"
+     "apply one gain per channel, and read them back the way the next\n"
+     "callback would see them. This shows how a format rounds and clips\n"
+     "values without opening a stream."},
     {NULL, NULL, 0, NULL},
 };
 
@@ -805,11 +3049,15 @@ PyMODINIT_FUNC initportaudio(void) {
 
     if (PyType_Ready(&StreamType) < 0)
         return;
+    if (PyType_Ready(&StreamGroupType) < 0)
+        return;
 
     m = Py_InitModule("portaudio", PortAudioMethods);
 
     Py_INCREF(&StreamType);
     PyModule_AddObject(m, "Stream", (PyObject*)&StreamType);
+    Py_INCREF(&StreamGroupType);
+    PyModule_AddObject(m, "StreamGroup", (PyObject*)&StreamGroupType);
 
     PortAudioError = PyErr_NewException("portaudio.Error", NULL, NULL);
     Py_INCREF(PortAudioError);
@@ -826,6 +3074,14 @@ PyMODINIT_FUNC initportaudio(void) {
     PyModule_AddIntConstant(m, "COMPLETE", paComplete);
     PyModule_AddIntConstant(m, "ABORT", paAbort);
 
+    PyModule_AddIntConstant(m, "CONCEAL_SILENCE", CONCEAL_SILENCE);
+    PyModule_AddIntConstant(m, "CONCEAL_REPEAT", CONCEAL_REPEAT);
+    PyModule_AddIntConstant(m, "CONCEAL_CROSSFADE", CONCEAL_CROSSFADE);
+
+    PyModule_AddIntConstant(m, "EVENT_GAIN", EVENT_GAIN);
+    PyModule_AddIntConstant(m, "EVENT_STOP", EVENT_STOP);
+    PyModule_AddIntConstant(m, "EVENT_TRIGGER", EVENT_TRIGGER);
+
     PyModule_AddIntConstant(m, "IN_DEVELOPMENT", paInDevelopment);
     PyModule_AddIntConstant(m, "DIRECT_SOUND", paDirectSound);
     PyModule_AddIntConstant(m, "MME", paMME);
@@ -0,0 +1,75 @@
+#!/usr/bin/env python2
+
+# Check the conversion kernels of every sample format and channel count
+# against a pure Python model, and report their throughput.
+
+import struct
+import sys
+import time
+
+import portaudio
+
+FRAMES = 512
+ROUNDS = 200
+
+# name: (lowest, highest) on the device scale
+FORMATS = [
+    ('FLOAT32', None),
+    ('INT32', (-2147483648, 2147483647)),
+    ('INT24', (-8388608, 8388607)),
+    ('INT16', (-32768, 32767)),
+    ('INT8', (-128, 127)),
+    ('UINT8', (0, 255)),
+]
+
+def to_float32(x):
+    return struct.unpack('f', struct.pack('f', x))[0]
+
+def pattern(limits, channels):
+    if limits is None:
+        return [to_float32((i % 41) / 10.0 - 2.0)
+                for i in range(FRAMES * channels)]
+    low, high = limits
+    step = (high - low) / 37
+    return [low + (i % 38) * step for i in range(FRAMES * channels)]
+
+def expected(limits, samples, gains):
+    channels = len(gains)
+    result = []
+    for i, value in enumerate(samples):
+        gain = gains[i % channels]
+        if limits is None:
+            result.append(to_float32(value * gain))
+            continue
+        # UINT8 is scaled around its centre
+        centre = 128 if limits[0] == 0 else 0
+        low, high = limits[0] - centre, limits[1] - centre
+        scaled = min(max((value - centre) * gain, low), high)
+        result.append(int(round(scaled)) + centre)
+    return result
+
+portaudio.initialize()
+failures = 0
+print '%-8s %8s %14s' % ('format', 'channels', 'frames/s')
+for name, limits in FORMATS:
+    format = getattr(portaudio, name)
+    for channels in range(1, 9):
+        samples = pattern(limits, channels)
+        # unity, attenuation, inversion and clipping
+        gains = [(1.0, 0.5, -1.0, 3.0)[c % 4] for c in range(channels)]
+        result = portaudio.convert_samples(format, channels, samples, gains)
+        if result != expected(limits, samples, gains):
+            failures += 1
+            print '%-8s %8d %14s' % (name, channels, 'FAILED')
+            continue
+
+        start = time.time()
+        for i in range(ROUNDS):
+            portaudio.convert_samples(format, channels, samples, gains)
+        elapsed = time.time() - start
+        print '%-8s %8d %14.0f' % (name, channels,
+                                   FRAMES * ROUNDS / elapsed)
+portaudio.terminate()
+
+print '%d failures' % failures
+sys.exit(failures != 0)